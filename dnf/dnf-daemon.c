@@ -0,0 +1,305 @@
+/* dnf-daemon.c
+ *
+ * Copyright © 2026 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Protocol (local UNIX stream socket):
+ *   client -> daemon: guint32 length of the arguments block, sent together with
+ *                     the client's stdin, stdout and stderr descriptors (SCM_RIGHTS)
+ *   client -> daemon: arguments block, NUL terminated argv strings
+ *   daemon -> client: gint32 exit status of the command or DNF_DAEMON_NOT_SERVED
+ *
+ * Every request is served in a forked child of the daemon. The child inherits
+ * the loaded context and sack and writes directly to the client's descriptors.
+ */
+
+#include "dnf-daemon.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <gio/gio.h>
+
+#define MAX_REQUEST_SIZE (1024 * 1024)
+
+static gboolean
+write_all (int fd, const void *buf, gsize len)
+{
+  const gchar *ptr = buf;
+  while (len > 0)
+    {
+      ssize_t ret = send (fd, ptr, len, MSG_NOSIGNAL);
+      if (ret < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return FALSE;
+        }
+      ptr += ret;
+      len -= ret;
+    }
+  return TRUE;
+}
+
+static gboolean
+read_all (int fd, void *buf, gsize len)
+{
+  gchar *ptr = buf;
+  while (len > 0)
+    {
+      ssize_t ret = recv (fd, ptr, len, 0);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret <= 0)
+        return FALSE;
+      ptr += ret;
+      len -= ret;
+    }
+  return TRUE;
+}
+
+static gboolean
+send_header (int fd, guint32 len, const int fds[3])
+{
+  union {
+    struct cmsghdr hdr;
+    gchar buf[CMSG_SPACE (3 * sizeof (int))];
+  } control;
+  memset (&control, 0, sizeof (control));
+
+  struct iovec iov = { .iov_base = &len, .iov_len = sizeof (len) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof (control.buf),
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (3 * sizeof (int));
+  memcpy (CMSG_DATA (cmsg), fds, 3 * sizeof (int));
+
+  ssize_t ret;
+  do
+    ret = sendmsg (fd, &msg, MSG_NOSIGNAL);
+  while (ret < 0 && errno == EINTR);
+  return ret == sizeof (len);
+}
+
+static gboolean
+recv_header (int fd, guint32 *len, int fds[3])
+{
+  union {
+    struct cmsghdr hdr;
+    gchar buf[CMSG_SPACE (3 * sizeof (int))];
+  } control;
+
+  struct iovec iov = { .iov_base = len, .iov_len = sizeof (*len) };
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control.buf,
+    .msg_controllen = sizeof (control.buf),
+  };
+
+  ssize_t ret;
+  do
+    ret = recvmsg (fd, &msg, 0);
+  while (ret < 0 && errno == EINTR);
+  if (ret != sizeof (*len))
+    return FALSE;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+  if (cmsg == NULL ||
+      cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN (3 * sizeof (int)))
+    return FALSE;
+  memcpy (fds, CMSG_DATA (cmsg), 3 * sizeof (int));
+  return TRUE;
+}
+
+/* Runs in the forked child. Returns the exit code of the child. */
+static gint
+serve_request (int conn, DnfDaemonRequestFunc request_func, gpointer user_data)
+{
+  guint32 len;
+  int fds[3];
+
+  /* the parent ignores SIGCHLD to reap its children, the command may need it */
+  signal (SIGCHLD, SIG_DFL);
+
+  if (!recv_header (conn, &len, fds))
+    return EXIT_FAILURE;
+  if (len == 0 || len > MAX_REQUEST_SIZE)
+    return EXIT_FAILURE;
+
+  g_autofree gchar *args_block = g_malloc (len + 1);
+  if (!read_all (conn, args_block, len))
+    return EXIT_FAILURE;
+  args_block[len] = '\0';
+
+  g_autoptr(GPtrArray) args = g_ptr_array_new ();
+  for (gchar *arg = args_block; arg < args_block + len; arg += strlen (arg) + 1)
+    g_ptr_array_add (args, arg);
+  gint argc = args->len;
+  g_ptr_array_add (args, NULL);
+
+  fflush (stdout);
+  fflush (stderr);
+  for (int i = 0; i < 3; ++i)
+    {
+      if (dup2 (fds[i], i) < 0)
+        return EXIT_FAILURE;
+      close (fds[i]);
+    }
+
+  gint32 status = request_func (argc, (gchar **)args->pdata, user_data);
+
+  fflush (stdout);
+  fflush (stderr);
+  write_all (conn, &status, sizeof (status));
+
+  return status == DNF_DAEMON_NOT_SERVED ? EXIT_FAILURE : status;
+}
+
+gboolean
+dnf_daemon_serve (const gchar           *socket_path,
+                  DnfDaemonRefreshFunc   refresh_func,
+                  DnfDaemonRequestFunc   request_func,
+                  gpointer               user_data,
+                  GError               **error)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen (socket_path) >= sizeof (addr.sun_path))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FILENAME_TOO_LONG,
+                   "Socket path is too long: %s", socket_path);
+      return FALSE;
+    }
+  strcpy (addr.sun_path, socket_path);
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Cannot create socket: %s", g_strerror (errno));
+      return FALSE;
+    }
+
+  /* remove a socket left by a previous instance, the socket is accessible only by the owner */
+  unlink (socket_path);
+  mode_t old_umask = umask (0077);
+  int ret = bind (fd, (struct sockaddr *)&addr, sizeof (addr));
+  umask (old_umask);
+  if (ret < 0 || listen (fd, 16) < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Cannot listen on socket %s: %s", socket_path, g_strerror (errno));
+      close (fd);
+      return FALSE;
+    }
+
+  /* finished children are reaped automatically */
+  signal (SIGCHLD, SIG_IGN);
+
+  while (TRUE)
+    {
+      int conn = accept (fd, NULL, NULL);
+      if (conn < 0)
+        {
+          if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                       "Cannot accept connection: %s", g_strerror (errno));
+          break;
+        }
+
+      if (refresh_func)
+        refresh_func (user_data);
+
+      pid_t pid = fork ();
+      if (pid == 0)
+        {
+          close (fd);
+          _exit (serve_request (conn, request_func, user_data));
+        }
+      if (pid < 0)
+        g_printerr ("Cannot fork request handler: %s\n", g_strerror (errno));
+      close (conn);
+    }
+
+  close (fd);
+  unlink (socket_path);
+  return FALSE;
+}
+
+/*
+ * Forwards the command to the daemon. Returns FALSE if the daemon is not reachable
+ * or refused the request, the caller runs the command locally in that case.
+ */
+gboolean
+dnf_daemon_client_run (const gchar  *socket_path,
+                       gint          argc,
+                       gchar        *argv[],
+                       gint         *exit_status)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen (socket_path) >= sizeof (addr.sun_path))
+    return FALSE;
+  strcpy (addr.sun_path, socket_path);
+
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return FALSE;
+  if (connect (fd, (struct sockaddr *)&addr, sizeof (addr)) < 0)
+    {
+      close (fd);
+      return FALSE;
+    }
+
+  g_autoptr(GString) args_block = g_string_new (NULL);
+  for (gint i = 0; i < argc; ++i)
+    g_string_append_len (args_block, argv[i], strlen (argv[i]) + 1);
+
+  const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  gint32 status;
+  if (!send_header (fd, args_block->len, fds) ||
+      !write_all (fd, args_block->str, args_block->len))
+    {
+      close (fd);
+      return FALSE;
+    }
+
+  if (!read_all (fd, &status, sizeof (status)))
+    /* the command was started but the handler died, its output may be already written */
+    status = EXIT_FAILURE;
+  close (fd);
+
+  if (status == DNF_DAEMON_NOT_SERVED)
+    return FALSE;
+
+  *exit_status = status;
+  return TRUE;
+}
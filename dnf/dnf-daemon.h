@@ -0,0 +1,49 @@
+/* dnf-daemon.h
+ *
+ * Copyright © 2026 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define DNF_DAEMON_DEFAULT_SOCKET "/run/microdnf.sock"
+
+/* Exit status returned by a request handler which refuses to serve the request.
+ * The client runs the command locally in that case. */
+#define DNF_DAEMON_NOT_SERVED -1
+
+/* Called in the parent process before a request is served. */
+typedef void (*DnfDaemonRefreshFunc) (gpointer user_data);
+
+/* Called in a forked child process with the stdin, stdout and stderr of the client.
+ * Returns the exit status for the client or DNF_DAEMON_NOT_SERVED. */
+typedef gint (*DnfDaemonRequestFunc) (gint argc, gchar *argv[], gpointer user_data);
+
+gboolean dnf_daemon_serve (const gchar           *socket_path,
+                           DnfDaemonRefreshFunc   refresh_func,
+                           DnfDaemonRequestFunc   request_func,
+                           gpointer               user_data,
+                           GError               **error);
+
+gboolean dnf_daemon_client_run (const gchar  *socket_path,
+                                gint          argc,
+                                gchar        *argv[],
+                                gint         *exit_status);
+
+G_END_DECLS
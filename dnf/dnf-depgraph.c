@@ -0,0 +1,396 @@
+/* dnf-depgraph.c
+ *
+ * Copyright © 2022 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dnf-depgraph.h"
+
+#include <string.h>
+
+#include <solv/pool.h>
+#include <solv/queue.h>
+#include <solv/repo.h>
+#include <solv/solvable.h>
+
+static gint
+gptrarr_dnf_package_cmp (gconstpointer a, gconstpointer b)
+{
+  DnfPackage *const *x = a;
+  DnfPackage *const *y = b;
+  return dnf_package_cmp (*x, *y);
+}
+
+/* Returns the installed packages in the dnf_package_cmp order, the nodes of the graph. */
+GPtrArray *
+dnf_depgraph_get_installed_packages (DnfSack *sack)
+{
+  hy_autoquery HyQuery query = hy_query_create (sack);
+  hy_query_filter (query, HY_PKG_REPONAME, HY_EQ, HY_SYSTEM_REPO_NAME);
+  GPtrArray *pkgs = hy_query_run (query);
+  g_ptr_array_sort (pkgs, gptrarr_dnf_package_cmp);
+  return pkgs;
+}
+
+void
+dnf_depgraph_free (DnfDepGraph *graph)
+{
+  g_free (graph->offsets);
+  g_free (graph->targets);
+  g_free (graph);
+}
+
+static gint
+guint_compare_func (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  guint x = *(const guint *)a;
+  guint y = *(const guint *)b;
+
+  if (x < y)
+    return -1;
+  return x > y;
+}
+
+/* libdnf creates the whatprovides index of the libsolv pool (including the file provides)
+ * lazily, when the first provides query runs. */
+static void
+make_provides_ready (DnfSack *sack)
+{
+  hy_autoquery HyQuery query = hy_query_create (sack);
+  hy_query_filter_provides (query, HY_EQ, "rpm", NULL);
+  g_autoptr(GPtrArray) pkgs = hy_query_run (query);
+}
+
+typedef struct
+{
+  guint from;
+  guint to;
+} Edge;
+
+typedef struct
+{
+  guint node;
+  Id dep;
+} PendingDep;
+
+/* Returns the offset of the providers of "dep" in pool->whatprovidesdata or 0 if libsolv
+ * has not computed them yet. libsolv computes the providers of versioned and rich
+ * dependencies lazily and that modifies the pool, reading the computed ones does not. */
+static Id
+lookup_whatprovides (Pool *pool, Id dep)
+{
+  return ISRELDEP (dep) ? pool->whatprovides_rel[GETRELID (dep)] : pool->whatprovides[dep];
+}
+
+/* Adds the edges from the node to the installed providers (excluding the node itself).
+ * Without "all_providers" the edge is added only if there is exactly one installed provider. */
+static void
+add_provider_edges (GArray *edges, Pool *pool, const gint *id2idx, guint node, Id whatprovides, gboolean all_providers)
+{
+  const guint len = edges->len;
+
+  for (const Id *p = pool->whatprovidesdata + whatprovides; *p; p++)
+    {
+      // the sack can be preloaded with available packages too (daemon mode)
+      if (id2idx[*p] < 0)
+        continue;
+      if (!all_providers && edges->len > len)
+        {
+          g_array_set_size (edges, len);
+          return;
+        }
+      Edge edge = { node, id2idx[*p] };
+      g_array_append_val (edges, edge);
+    }
+
+  // skip the self-edge
+  for (guint i = len; i < edges->len; i++)
+    if (g_array_index (edges, Edge, i).to == node)
+      {
+        g_array_remove_index_fast (edges, i);
+        break;
+      }
+}
+
+typedef struct
+{
+  Pool *pool;
+  const GPtrArray *pkgs;
+  const gint *id2idx;
+  DnfDepGraphFlags flags;
+  guint start;
+  guint end;
+  GArray *edges;    // Edge
+  GArray *pending;  // PendingDep, the dependencies with not yet computed providers
+} EdgeWorker;
+
+static void
+add_edges (EdgeWorker *worker, guint node, Solvable *s, Id keyname, Id marker, Queue *deps)
+{
+  solvable_lookup_deparray (s, keyname, deps, marker);
+
+  // resolve dependencies using the whatprovides index
+  for (int j = 0; j < deps->count; j++)
+    {
+      const Id dep = deps->elements[j];
+      const Id whatprovides = lookup_whatprovides (worker->pool, dep);
+      if (!whatprovides)
+        {
+          PendingDep pending = { node, dep };
+          g_array_append_val (worker->pending, pending);
+          continue;
+        }
+
+      add_provider_edges (worker->edges, worker->pool, worker->id2idx, node, whatprovides,
+                          worker->flags & DNF_DEPGRAPH_FLAG_ALL_PROVIDERS);
+    }
+}
+
+/* Resolves the dependencies of the packages start .. end - 1. Only reads the pool,
+ * the workers run in parallel. */
+static gpointer
+edge_worker_run (gpointer data)
+{
+  EdgeWorker *worker = data;
+  Queue deps;
+  queue_init (&deps);
+
+  for (guint i = worker->start; i < worker->end; i++)
+    {
+      DnfPackage *pkg = g_ptr_array_index (worker->pkgs, i);
+      Solvable *s = pool_id2solvable (worker->pool, dnf_package_get_id (pkg));
+      // -1 skips the pre-requires like dnf_package_get_requires () does, 0 reads all of them
+      add_edges (worker, i, s, SOLVABLE_REQUIRES,
+                 worker->flags & DNF_DEPGRAPH_FLAG_PREREQUIRES ? 0 : -1, &deps);
+      if (worker->flags & DNF_DEPGRAPH_FLAG_RECOMMENDS)
+        add_edges (worker, i, s, SOLVABLE_RECOMMENDS, 0, &deps);
+    }
+
+  queue_free (&deps);
+  return NULL;
+}
+
+/* Builds the graph of the dependencies between the "pkgs" (the result of
+ * dnf_depgraph_get_installed_packages). There is an edge from a package to each package
+ * which is the only installed provider of one of its requires (and pre-requires with
+ * DNF_DEPGRAPH_FLAG_PREREQUIRES, recommends with DNF_DEPGRAPH_FLAG_RECOMMENDS), to every
+ * installed provider with DNF_DEPGRAPH_FLAG_ALL_PROVIDERS. */
+DnfDepGraph *
+dnf_depgraph_new (DnfSack *sack, const GPtrArray *pkgs, DnfDepGraphFlags flags)
+{
+  Pool *pool = dnf_sack_get_pool (sack);
+  make_provides_ready (sack);
+
+  // map solvable ids of the installed packages to their index in pkgs, -1 for the others
+  g_autofree gint *id2idx = g_malloc (pool->nsolvables * sizeof (*id2idx));
+  for (int id = 0; id < pool->nsolvables; id++)
+    id2idx[id] = -1;
+  for (guint i = 0; i < pkgs->len; i++)
+    id2idx[dnf_package_get_id (g_ptr_array_index (pkgs, i))] = i;
+
+  // resolve the dependencies of contiguous ranges of packages in parallel,
+  // every worker collects the edges into its own buffer
+  const guint nworkers = CLAMP (pkgs->len / 256, 1, g_get_num_processors ());
+  g_autofree EdgeWorker *workers = g_new (EdgeWorker, nworkers);
+  g_autofree GThread **threads = g_new0 (GThread *, nworkers);
+  for (guint w = 0; w < nworkers; w++)
+    {
+      EdgeWorker *worker = &workers[w];
+      worker->pool = pool;
+      worker->pkgs = pkgs;
+      worker->id2idx = id2idx;
+      worker->flags = flags;
+      worker->start = (guint64)pkgs->len * w / nworkers;
+      worker->end = (guint64)pkgs->len * (w + 1) / nworkers;
+      worker->edges = g_array_new (FALSE, FALSE, sizeof (Edge));
+      worker->pending = g_array_new (FALSE, FALSE, sizeof (PendingDep));
+      if (w > 0)
+        threads[w] = g_thread_new ("leaves-edges", edge_worker_run, worker);
+    }
+  edge_worker_run (&workers[0]);
+  for (guint w = 1; w < nworkers; w++)
+    g_thread_join (threads[w]);
+
+  // the providers not computed yet are resolved here, computing them modifies the pool
+  g_autoptr(GArray) pending_edges = g_array_new (FALSE, FALSE, sizeof (Edge));
+  for (guint w = 0; w < nworkers; w++)
+    {
+      GArray *pending = workers[w].pending;
+      for (guint j = 0; j < pending->len; j++)
+        {
+          const PendingDep *dep = &g_array_index (pending, PendingDep, j);
+          add_provider_edges (pending_edges, pool, id2idx, dep->node, pool_whatprovides (pool, dep->dep),
+                              flags & DNF_DEPGRAPH_FLAG_ALL_PROVIDERS);
+        }
+      g_array_free (pending, TRUE);
+    }
+
+  // merge the edge buffers into the CSR layout, the result does not depend on the order
+  // of the buffers because the edges of every node are sorted and deduplicated
+  DnfDepGraph *graph = g_new (DnfDepGraph, 1);
+  graph->nnodes = pkgs->len;
+  graph->offsets = g_malloc0 ((pkgs->len + 1) * sizeof (*graph->offsets));
+  for (guint w = 0; w <= nworkers; w++)
+    {
+      GArray *edges = w < nworkers ? workers[w].edges : pending_edges;
+      for (guint j = 0; j < edges->len; j++)
+        graph->offsets[g_array_index (edges, Edge, j).from + 1]++;
+    }
+  for (guint i = 0; i < pkgs->len; i++)
+    graph->offsets[i + 1] += graph->offsets[i];
+
+  graph->targets = g_malloc (graph->offsets[pkgs->len] * sizeof (*graph->targets));
+  g_autofree guint *fill = g_malloc ((pkgs->len + 1) * sizeof (*fill));
+  memcpy (fill, graph->offsets, (pkgs->len + 1) * sizeof (*fill));
+  for (guint w = 0; w <= nworkers; w++)
+    {
+      GArray *edges = w < nworkers ? workers[w].edges : pending_edges;
+      for (guint j = 0; j < edges->len; j++)
+        {
+          const Edge *edge = &g_array_index (edges, Edge, j);
+          graph->targets[fill[edge->from]++] = edge->to;
+        }
+      if (w < nworkers)
+        g_array_free (edges, TRUE);
+    }
+
+  guint len = 0;
+  for (guint i = 0; i < pkgs->len; i++)
+    {
+      guint *edges = &graph->targets[graph->offsets[i]];
+      const guint nedges = graph->offsets[i + 1] - graph->offsets[i];
+      g_qsort_with_data (edges, nedges, sizeof (*edges), guint_compare_func, NULL);
+
+      // move the unique edges down to close the gaps left by the duplicates of the previous nodes
+      const guint start = len;
+      graph->offsets[i] = start;
+      for (guint j = 0; j < nedges; j++)
+        if (len == start || graph->targets[len - 1] != edges[j])
+          graph->targets[len++] = edges[j];
+    }
+  graph->offsets[pkgs->len] = len;
+
+  return graph;
+}
+
+/* Finds the strongly connected components in one depth-first pass using Pearce's space-efficient
+ * variant of Tarjan's algorithm. Returns the component number of each node, the components
+ * are numbered 0 .. ncomponents - 1 in reverse topological order. */
+guint *
+dnf_depgraph_find_components (const DnfDepGraph *graph, guint *ncomponents)
+{
+  const guint N = graph->nnodes;
+  guint *rindex = g_malloc0 (N * sizeof (*rindex));
+  g_autofree guint64 *root = dnf_bitset_new (N);
+  g_autofree guint *dfs_stack = g_malloc (N * sizeof (*dfs_stack));
+  g_autofree guint *next_edge = g_malloc (N * sizeof (*next_edge));
+  g_autofree guint *scc_stack = g_malloc (N * sizeof (*scc_stack));
+  guint index = 1;
+  guint c = N - 1;
+  guint scc_top = 0;
+
+  // rindex is 0 for unvisited nodes, the visit index (at most the number of the unfinished
+  // nodes) or the minimal reachable visit index for nodes on the stacks and c (counting
+  // down from N - 1) for the nodes in finished components
+  for (guint i = 0; i < N; i++)
+    {
+      if (rindex[i] != 0)
+        continue;
+
+      guint dfs_top = 0;
+      dfs_stack[dfs_top++] = i;
+      next_edge[i] = graph->offsets[i];
+      rindex[i] = index++;
+      dnf_bitset_set (root, i);
+      while (dfs_top)
+        {
+          const guint v = dfs_stack[dfs_top - 1];
+          if (next_edge[v] < graph->offsets[v + 1])
+            {
+              const guint w = graph->targets[next_edge[v]++];
+              if (rindex[w] == 0)
+                {
+                  dfs_stack[dfs_top++] = w;
+                  next_edge[w] = graph->offsets[w];
+                  rindex[w] = index++;
+                  dnf_bitset_set (root, w);
+                }
+              else if (rindex[w] < rindex[v])
+                {
+                  rindex[v] = rindex[w];
+                  dnf_bitset_clear (root, v);
+                }
+              continue;
+            }
+
+          // all edges of v are processed
+          dfs_top--;
+          if (dnf_bitset_test (root, v))
+            {
+              // v is the root of a component, the rest of it is on the top of scc_stack
+              index--;
+              while (scc_top && rindex[v] <= rindex[scc_stack[scc_top - 1]])
+                {
+                  rindex[scc_stack[--scc_top]] = c;
+                  index--;
+                }
+              rindex[v] = c--;
+            }
+          else
+            scc_stack[scc_top++] = v;
+
+          if (dfs_top)
+            {
+              const guint u = dfs_stack[dfs_top - 1];
+              if (rindex[v] < rindex[u])
+                {
+                  rindex[u] = rindex[v];
+                  dnf_bitset_clear (root, u);
+                }
+            }
+        }
+    }
+
+  for (guint i = 0; i < N; i++)
+    rindex[i] = N - 1 - rindex[i];
+  *ncomponents = N - 1 - c;
+
+  return rindex;
+}
+
+/* Returns the graph with all the edges reversed. */
+DnfDepGraph *
+dnf_depgraph_new_reversed (const DnfDepGraph *graph)
+{
+  const guint N = graph->nnodes;
+  DnfDepGraph *rgraph = g_new (DnfDepGraph, 1);
+  rgraph->nnodes = N;
+  rgraph->offsets = g_malloc0 ((N + 1) * sizeof (*rgraph->offsets));
+  rgraph->targets = g_malloc (graph->offsets[N] * sizeof (*rgraph->targets));
+
+  for (guint e = 0; e < graph->offsets[N]; e++)
+    rgraph->offsets[graph->targets[e] + 1]++;
+  for (guint i = 0; i < N; i++)
+    rgraph->offsets[i + 1] += rgraph->offsets[i];
+
+  // the sources are visited in ascending order, so the reversed edges stay sorted
+  g_autofree guint *fill = g_malloc ((N + 1) * sizeof (*fill));
+  memcpy (fill, rgraph->offsets, (N + 1) * sizeof (*fill));
+  for (guint u = 0; u < N; u++)
+    for (guint e = graph->offsets[u]; e < graph->offsets[u + 1]; e++)
+      rgraph->targets[fill[graph->targets[e]]++] = u;
+
+  return rgraph;
+}
@@ -0,0 +1,78 @@
+/* dnf-depgraph.h
+ *
+ * Copyright © 2022 Emil Renner Berthing <esmil@mailme.dk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <glib.h>
+#include <libdnf/libdnf.h>
+
+G_BEGIN_DECLS
+
+#define DNF_BITSET_WORDS(n) (((n) + 63) / 64)
+
+static inline guint64 *
+dnf_bitset_new (guint n)
+{
+  return g_malloc0 (DNF_BITSET_WORDS (n) * sizeof (guint64));
+}
+
+static inline void
+dnf_bitset_set (guint64 *set, guint i)
+{
+  set[i / 64] |= G_GUINT64_CONSTANT (1) << (i % 64);
+}
+
+static inline void
+dnf_bitset_clear (guint64 *set, guint i)
+{
+  set[i / 64] &= ~(G_GUINT64_CONSTANT (1) << (i % 64));
+}
+
+static inline gboolean
+dnf_bitset_test (const guint64 *set, guint i)
+{
+  return (set[i / 64] >> (i % 64)) & 1;
+}
+
+/* Directed graph of the dependencies between the installed packages in the compressed sparse
+ * row layout. The nodes are the indexes of the packages in the dnf_package_cmp order, the sorted
+ * targets of the edges from the node u are targets[offsets[u]] .. targets[offsets[u + 1] - 1]. */
+typedef struct
+{
+  guint nnodes;
+  guint *offsets;
+  guint *targets;
+} DnfDepGraph;
+
+typedef enum
+{
+  DNF_DEPGRAPH_FLAG_NONE = 0,
+  DNF_DEPGRAPH_FLAG_RECOMMENDS = 1 << 0,     // add the edges for the recommends too
+  DNF_DEPGRAPH_FLAG_ALL_PROVIDERS = 1 << 1,  // add the edges to all the installed providers of a dependency
+  DNF_DEPGRAPH_FLAG_PREREQUIRES = 1 << 2,    // add the edges for the Requires(pre) and Requires(post) too
+} DnfDepGraphFlags;
+
+GPtrArray *dnf_depgraph_get_installed_packages (DnfSack *sack);
+DnfDepGraph *dnf_depgraph_new (DnfSack *sack, const GPtrArray *pkgs, DnfDepGraphFlags flags);
+DnfDepGraph *dnf_depgraph_new_reversed (const DnfDepGraph *graph);
+void dnf_depgraph_free (DnfDepGraph *graph);
+guint *dnf_depgraph_find_components (const DnfDepGraph *graph, guint *ncomponents);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (DnfDepGraph, dnf_depgraph_free)
+
+G_END_DECLS
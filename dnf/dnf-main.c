@@ -20,12 +20,14 @@
  */
 
 #include <locale.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <glib.h>
 #include <libpeas/peas.h>
 #include <libdnf/libdnf.h>
 #include "dnf-command.h"
+#include "dnf-daemon.h"
 #include "dnf-utils.h"
 
 typedef enum { ARG_DEFAULT, ARG_FALSE, ARG_TRUE } BoolArgs;
@@ -40,6 +42,9 @@ static gboolean opt_best = FALSE;
 static gboolean opt_nobest = FALSE;
 static gboolean opt_test = FALSE;
 static gboolean opt_refresh = FALSE;
+static gboolean opt_timings = FALSE;
+static gboolean opt_use_daemon = FALSE;
+static gchar *opt_daemon_socket = NULL;
 static gboolean show_help = FALSE;
 static gboolean dl_pkgs_printed = FALSE;
 static GSList *enable_disable_repos = NULL;
@@ -120,6 +125,7 @@ process_global_option (const gchar  *option_name,
       else if (strchr (setopt[0], '.'))
         { /* repository option, pass to libdnf */
           ret = dnf_conf_add_setopt (setopt[0], DNF_CONF_COMMANDLINE, setopt[1], &local_error);
+          dnf_utils_set_repo_setopt_given ();
         }
       else if (strcmp (setopt[0], "tsflags") == 0)
         {
@@ -252,6 +258,7 @@ static const GOptionEntry global_opts[] = {
   { "assumeyes", 'y', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_yes, "Automatically answer yes for all questions", NULL },
   { "best", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_best, "Try the best available package versions in transactions", NULL },
   { "config", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK, process_global_option, "Configuration file location", "<config file>" },
+  { "daemon-socket", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &opt_daemon_socket, "Socket of the microdnf daemon (default: "DNF_DAEMON_DEFAULT_SOCKET")", "PATH" },
   { "disablerepo", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK, process_global_option, "Disable repository by an id", "ID" },
   { "disableplugin", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK, process_global_option, "Disable plugins by name", "name" },
   { "enablerepo", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK, process_global_option, "Enable repository by an id", "ID" },
@@ -264,6 +271,8 @@ static const GOptionEntry global_opts[] = {
   { "releasever", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK, process_global_option, "Override the value of $releasever in config and repo files", "RELEASEVER" },
   { "setopt", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_CALLBACK, process_global_option,
     "Override a configuration option (install_weak_deps=0/1, allow_vendor_change=0/1, keepcache=0/1, module_platform_id=<name:stream>, cachedir=<path>, reposdir=<path1>,<path2>,..., tsflags=nodocs/test, varsdir=<path1>,<path2>,..., repo_id.option_name=<value>)", "<option>=<value>" },
+  { "timings", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_timings, "Print per-phase wall-clock and CPU times to stderr at exit", NULL },
+  { "use-daemon", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_use_daemon, "Run read-only commands in the microdnf daemon if it is running", NULL },
   { NULL }
 };
 
@@ -297,10 +306,15 @@ state_action_changed_cb (DnfState       *state,
 {
   switch (action)
     {
+      case DNF_STATE_ACTION_LOADING_CACHE:
+        dnf_utils_timings_phase ("sack setup");
+        break;
       case DNF_STATE_ACTION_DOWNLOAD_METADATA:
+        dnf_utils_timings_phase ("metadata download");
         g_print ("Downloading metadata...\n");
         break;
       case DNF_STATE_ACTION_DOWNLOAD_PACKAGES:
+        dnf_utils_timings_phase ("package download");
         if (!dl_pkgs_printed)
           {
             g_print ("Downloading packages...\n");
@@ -308,33 +322,41 @@ state_action_changed_cb (DnfState       *state,
           }
         break;
       case DNF_STATE_ACTION_TEST_COMMIT:
+        dnf_utils_timings_phase ("transaction test");
         g_print ("Running transaction test...\n");
         break;
       case DNF_STATE_ACTION_INSTALL:
+        dnf_utils_timings_phase ("rpm transaction");
         if (action_hint)
           g_print ("Installing: %s\n", action_hint);
         break;
       case DNF_STATE_ACTION_REMOVE:
+        dnf_utils_timings_phase ("rpm transaction");
         if (action_hint)
           g_print ("Removing: %s\n", action_hint);
         break;
       case DNF_STATE_ACTION_UPDATE:
+        dnf_utils_timings_phase ("rpm transaction");
         if (action_hint)
           g_print ("Updating: %s\n", action_hint);
         break;
       case DNF_STATE_ACTION_OBSOLETE:
+        dnf_utils_timings_phase ("rpm transaction");
         if (action_hint)
           g_print ("Obsoleting: %s\n", action_hint);
         break;
       case DNF_STATE_ACTION_REINSTALL:
+        dnf_utils_timings_phase ("rpm transaction");
         if (action_hint)
           g_print ("Reinstalling: %s\n", action_hint);
         break;
       case DNF_STATE_ACTION_DOWNGRADE:
+        dnf_utils_timings_phase ("rpm transaction");
         if (action_hint)
           g_print ("Downgrading: %s\n", action_hint);
         break;
       case DNF_STATE_ACTION_CLEANUP:
+        dnf_utils_timings_phase ("rpm transaction");
         if (action_hint)
           g_print ("Cleanup: %s\n", action_hint);
         break;
@@ -355,6 +377,36 @@ new_global_opt_group (DnfContext *ctx)
   return opt_grp;
 }
 
+/*
+ * Returns the first global option found in the arguments, or NULL.
+ * The global options are applied once when the context is set up,
+ * the commands run later against the same context cannot change them.
+ */
+static const gchar *
+find_global_option (int argc, char *argv[])
+{
+  for (gint in = 1; in < argc; in++)
+    {
+      const gchar *arg = argv[in];
+      if (g_strcmp0 (arg, "--") == 0)
+        break;
+      if (arg[0] != '-' || arg[1] == '\0')
+        continue;
+      for (const GOptionEntry *entry = global_opts; entry->long_name; ++entry)
+        {
+          if (arg[1] == '-')
+            {
+              gsize len = strlen (entry->long_name);
+              if (strncmp (arg + 2, entry->long_name, len) == 0 && (arg[2 + len] == '\0' || arg[2 + len] == '='))
+                return arg;
+            }
+          else if (entry->short_name && strchr (arg + 1, entry->short_name))
+            return arg;
+        }
+    }
+  return NULL;
+}
+
 /*
  * The first non-option is the command/subcommand.
  * Get it and remove it from arguments.
@@ -382,6 +434,490 @@ compare_strings (gconstpointer a,
   return strcmp (a, b);
 }
 
+/* Data needed to find and load the plugins implementing commands. */
+typedef struct {
+  PeasEngine       *engine;
+  PeasExtensionSet *cmd_exts;
+  GHashTable       *cmds_aliases;       /* dictionary of aliases for commands */
+  GSList           *cmds_with_subcmds;  /* list of commands with subcommands */
+} CommandsInfo;
+
+/* Commands implemented directly by microdnf, they need to find and run other commands. */
+typedef struct {
+  const gchar *name;
+  const gchar *description;
+  gboolean (*run) (CommandsInfo *cmds, DnfContext *ctx, int argc, char *argv[], GError **error);
+} BuiltinCommand;
+
+static gboolean run_daemon (CommandsInfo *cmds, DnfContext *ctx, int argc, char *argv[], GError **error);
+static gboolean run_shell (CommandsInfo *cmds, DnfContext *ctx, int argc, char *argv[], GError **error);
+
+static const BuiltinCommand builtin_cmds[] = {
+  { "daemon", "Serve read-only commands from a preloaded sack over a local socket", run_daemon },
+  { "shell", "Run commands from a file or stdin against one loaded sack", run_shell },
+  { NULL }
+};
+
+/*
+ * Plugins implementing commands have the "command_" module name prefix.
+ */
+static gboolean
+plugin_is_command (PeasPluginInfo *info)
+{
+  return g_str_has_prefix (peas_plugin_info_get_module_name (info), "command_");
+}
+
+/*
+ * Plugins with a '_' character in the name implement subcommands.
+ * E.g. the "command_module_enable" plugin implements the "enable" subcommand of the "module" command.
+ * Replaces the first '_' in command_name by a space and returns the length of the command part,
+ * or 0 if the plugin does not implement a subcommand.
+ */
+static gsize
+split_subcommand_name (gchar *command_name)
+{
+  gchar *ptr = strchr (command_name, '_');
+  if (ptr == NULL)
+    return 0;
+  *ptr = ' ';
+  return ptr - command_name;
+}
+
+/*
+ * Reads the "X-<key>" boolean plugin metadata declaring which setup stage the command needs.
+ * Stages are needed unless declared as "false".
+ */
+static gboolean
+plugin_needs (PeasPluginInfo *info, const gchar *key)
+{
+  const gchar *value = peas_plugin_info_get_external_data (info, key);
+  return value == NULL || g_ascii_strcasecmp (value, "false") != 0;
+}
+
+/*
+ * Collects command aliases and commands with subcommands from the plugins metadata.
+ * No plugin is loaded.
+ */
+static void
+scan_commands (PeasEngine  *engine,
+               GHashTable  *cmds_aliases,
+               GSList     **cmds_with_subcmds)
+{
+  for (const GList *plugin = peas_engine_get_plugin_list (engine);
+       plugin != NULL;
+       plugin = plugin->next)
+    {
+      PeasPluginInfo *info = plugin->data;
+      if (!plugin_is_command (info))
+        continue;
+
+      g_autofree gchar *command_name = g_strdup (peas_plugin_info_get_name (info));
+      gsize cmd_len = split_subcommand_name (command_name);
+      if (cmd_len > 0)
+        *cmds_with_subcmds = g_slist_append (*cmds_with_subcmds, g_strndup (command_name, cmd_len));
+
+      /* Add command alias to the dictionary. */
+      const gchar *command_alias_name = peas_plugin_info_get_external_data (info, "Alias-Name");
+      if (command_alias_name)
+        g_hash_table_insert (cmds_aliases, g_strdup (command_alias_name), g_strdup (command_name));
+    }
+}
+
+/*
+ * Loads all plugins and returns the summary of the provided commands for the help.
+ */
+static gchar *
+get_commands_summary (PeasEngine *engine)
+{
+  GString *cmd_summary = g_string_new ("Commands:");
+  for (const GList *plugin = peas_engine_get_plugin_list (engine);
+       plugin != NULL;
+       plugin = plugin->next)
+    {
+      PeasPluginInfo *info = plugin->data;
+      if (!peas_engine_load_plugin (engine, info))
+        continue;
+      if (peas_engine_provides_extension (engine, info, DNF_TYPE_COMMAND))
+        {
+          g_autofree gchar *command_name = g_strdup (peas_plugin_info_get_name (info));
+          const gchar *command_alias_name = peas_plugin_info_get_external_data (info, "Alias-Name");
+          split_subcommand_name (command_name);
+
+          /*
+           * At least 2 spaces between the command and its description are needed
+           * so that help2man formats it correctly.
+           */
+          g_string_append_printf (cmd_summary, "\n  %-16s     %s", command_name, peas_plugin_info_get_description (info));
+
+          /* If command has an alias with a description, add it to the help. */
+          const gchar *command_alias_description = peas_plugin_info_get_external_data (info, "Alias-Description");
+          if (command_alias_name && command_alias_description)
+            g_string_append_printf (cmd_summary, "\n  %-16s     %s", command_alias_name, command_alias_description);
+        }
+    }
+  for (const BuiltinCommand *builtin = builtin_cmds; builtin->name; ++builtin)
+    g_string_append_printf (cmd_summary, "\n  %-16s     %s", builtin->name, builtin->description);
+  return g_string_free (cmd_summary, FALSE);
+}
+
+/*
+ * Finds the plugin that implements the command cmd_name or its subcommand.
+ * The subcommand name is taken from the arguments.
+ * Command name (cmd_name) can not contain '_' character. It is reserved for subcomands.
+ */
+static PeasPluginInfo *
+find_command_plugin (CommandsInfo  *cmds,
+                     const gchar   *cmd_name,
+                     int           *argc,
+                     char          *argv[],
+                     const gchar  **subcmd_name,
+                     gboolean      *with_subcmds)
+{
+  PeasPluginInfo *plug = NULL;
+
+  *subcmd_name = NULL;
+  *with_subcmds = FALSE;
+  if (cmd_name == NULL || strchr(cmd_name, '_') != NULL)
+    return NULL;
+
+  const gchar *original_cmd_name = g_hash_table_lookup (cmds->cmds_aliases, cmd_name);
+  const gchar *search_cmd_name = original_cmd_name ? original_cmd_name : cmd_name;
+  *with_subcmds = g_slist_find_custom (cmds->cmds_with_subcmds, search_cmd_name, compare_strings) != NULL;
+  g_autofree gchar *mod_name = g_strdup_printf ("command_%s", search_cmd_name);
+  plug = peas_engine_get_plugin_info (cmds->engine, mod_name);
+  if (plug == NULL && *with_subcmds)
+    {
+      *subcmd_name = get_command (argc, argv);
+      if (*subcmd_name != NULL)
+        {
+          g_autofree gchar *submod_name = g_strdup_printf ("command_%s_%s", search_cmd_name, *subcmd_name);
+          plug = peas_engine_get_plugin_info (cmds->engine, submod_name);
+        }
+    }
+  return plug;
+}
+
+/*
+ * Loads the plugin that implements the command and returns the command extension.
+ */
+static PeasExtension *
+load_command (CommandsInfo *cmds, PeasPluginInfo *plug)
+{
+  if (plug == NULL || !peas_engine_load_plugin (cmds->engine, plug))
+    return NULL;
+  return peas_extension_set_get_extension (cmds->cmd_exts, plug);
+}
+
+static gboolean
+run_command (PeasPluginInfo  *plug,
+             PeasExtension   *exten,
+             DnfContext      *ctx,
+             int              argc,
+             char            *argv[],
+             GError         **error)
+{
+  g_autofree gchar *subcmd_opt_param = g_strdup_printf ("%s - %s",
+    peas_plugin_info_get_external_data (plug, "Command-Syntax"),
+    peas_plugin_info_get_description (plug));
+  g_autoptr(GOptionContext) subcmd_opt_ctx = g_option_context_new (subcmd_opt_param);
+  g_option_context_add_group (subcmd_opt_ctx, new_global_opt_group (ctx));
+  return dnf_command_run (DNF_COMMAND (exten), argc, argv, subcmd_opt_ctx, ctx, error);
+}
+
+static void
+print_error (const GError *error)
+{
+  const gchar *prefix = "";
+  const gchar *suffix = "";
+  if (isatty (1))
+    {
+      prefix = "\x1b[31m\x1b[1m"; /* red, bold */
+      suffix = "\x1b[22m\x1b[0m"; /* bold off, color reset */
+    }
+  g_printerr ("%serror: %s%s\n", prefix, suffix, error->message);
+}
+
+/*
+ * Loads the sack with both the installed packages and the enabled repositories
+ * and marks it as preloaded. The commands filter the packages they need.
+ */
+static gboolean
+setup_preloaded_sack (DnfContext *ctx, gchar **rpmdb_cookie, GError **error)
+{
+  DnfState *state = dnf_context_get_state (ctx);
+  dnf_state_reset (state);
+  if (!dnf_context_setup_sack_with_flags (ctx, state, DNF_CONTEXT_SETUP_SACK_FLAG_NONE, error))
+    return FALSE;
+  g_free (*rpmdb_cookie);
+  *rpmdb_cookie = dnf_utils_get_rpmdb_cookie (ctx);
+  dnf_utils_set_sack_preloaded (TRUE);
+  return TRUE;
+}
+
+typedef struct {
+  CommandsInfo *cmds;
+  DnfContext   *ctx;
+  gchar        *rpmdb_cookie;  /* rpmdb state the sack was loaded with */
+} DaemonData;
+
+static volatile sig_atomic_t daemon_reload_requested = FALSE;
+
+static void
+daemon_sighup_handler (int signum)
+{
+  daemon_reload_requested = TRUE;
+}
+
+/*
+ * Reloads the sack if the rpmdb was changed or SIGHUP was received (e.g. after "makecache").
+ * Runs in the daemon before every request.
+ */
+static void
+daemon_refresh_cb (gpointer user_data)
+{
+  DaemonData *data = user_data;
+  g_autofree gchar *rpmdb_cookie = dnf_utils_get_rpmdb_cookie (data->ctx);
+  if (!daemon_reload_requested && g_strcmp0 (rpmdb_cookie, data->rpmdb_cookie) == 0)
+    return;
+
+  g_autoptr(GError) error = NULL;
+  daemon_reload_requested = FALSE;
+  if (!setup_preloaded_sack (data->ctx, &data->rpmdb_cookie, &error))
+    g_printerr ("Failed to reload the sack: %s\n", error->message);
+}
+
+/*
+ * Runs the requested command in a forked child of the daemon.
+ * Only commands marked as read-only are served. Requests with global options or help
+ * are left to the client, the context of the daemon is already set up.
+ */
+static gint
+daemon_request_cb (gint argc, gchar *argv[], gpointer user_data)
+{
+  DaemonData *data = user_data;
+
+  if (argc < 2 || argv[1][0] == '-' || find_global_option (argc, argv) != NULL)
+    return DNF_DAEMON_NOT_SERVED;
+  for (gint in = 2; in < argc; in++)
+    {
+      if (g_strcmp0 (argv[in], "--") == 0)
+        break;
+      if (g_strcmp0 (argv[in], "-h") == 0 || g_str_has_prefix (argv[in], "--help"))
+        return DNF_DAEMON_NOT_SERVED;
+    }
+
+  const gchar *subcmd_name;
+  gboolean with_subcmds;
+  const gchar *cmd_name = get_command (&argc, argv);
+  PeasPluginInfo *plug = find_command_plugin (data->cmds, cmd_name, &argc, argv, &subcmd_name, &with_subcmds);
+  if (plug == NULL || g_strcmp0 (peas_plugin_info_get_external_data (plug, "Read-Only"), "true") != 0)
+    return DNF_DAEMON_NOT_SERVED;
+  PeasExtension *exten = load_command (data->cmds, plug);
+  if (exten == NULL)
+    return DNF_DAEMON_NOT_SERVED;
+
+  g_autoptr(GError) error = NULL;
+  if (!run_command (plug, exten, data->ctx, argc, argv, &error))
+    {
+      if (error != NULL)
+        print_error (error);
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
+
+static gboolean
+run_daemon (CommandsInfo  *cmds,
+            DnfContext    *ctx,
+            int            argc,
+            char          *argv[],
+            GError       **error)
+{
+  g_autoptr(GOptionContext) opt_ctx = g_option_context_new ("daemon - Serve read-only commands from a preloaded sack");
+  g_option_context_add_group (opt_ctx, new_global_opt_group (ctx));
+  if (!g_option_context_parse (opt_ctx, &argc, &argv, error))
+    return FALSE;
+
+  if (argc > 1)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_UNKNOWN_OPTION, "Unknown argument %s", argv[1]);
+      return FALSE;
+    }
+
+  DaemonData data = { cmds, ctx, NULL };
+  if (!setup_preloaded_sack (ctx, &data.rpmdb_cookie, error))
+    return FALSE;
+  signal (SIGHUP, daemon_sighup_handler);
+
+  const gchar *socket_path = opt_daemon_socket ? opt_daemon_socket : DNF_DAEMON_DEFAULT_SOCKET;
+  g_print ("Serving commands on %s\n", socket_path);
+  gboolean ret = dnf_daemon_serve (socket_path, daemon_refresh_cb, daemon_request_cb, &data, error);
+  g_free (data.rpmdb_cookie);
+  return ret;
+}
+
+/*
+ * Some commands disable the repositories they do not need. The shell restores
+ * the enabled state after each command.
+ */
+static GArray *
+save_repos_enabled (DnfContext *ctx)
+{
+  GPtrArray *repos = dnf_context_get_repos (ctx);
+  GArray *enabled = g_array_sized_new (FALSE, FALSE, sizeof (DnfRepoEnabled), repos->len);
+  for (guint i = 0; i < repos->len; ++i)
+    {
+      DnfRepoEnabled repo_enabled = dnf_repo_get_enabled (g_ptr_array_index (repos, i));
+      g_array_append_val (enabled, repo_enabled);
+    }
+  return enabled;
+}
+
+static void
+restore_repos_enabled (DnfContext *ctx, GArray *enabled)
+{
+  GPtrArray *repos = dnf_context_get_repos (ctx);
+  for (guint i = 0; i < repos->len && i < enabled->len; ++i)
+    dnf_repo_set_enabled (g_ptr_array_index (repos, i), g_array_index (enabled, DnfRepoEnabled, i));
+}
+
+/*
+ * Parses and runs one command line of the shell.
+ */
+static gboolean
+run_shell_line (CommandsInfo  *cmds,
+                DnfContext    *ctx,
+                const gchar   *prg_name,
+                const gchar   *line,
+                GError       **error)
+{
+  g_auto(GStrv) line_argv = NULL;
+  gint line_argc;
+  if (!g_shell_parse_argv (line, &line_argc, &line_argv, error))
+    return FALSE;
+
+  g_autoptr(GPtrArray) args = g_ptr_array_sized_new (line_argc + 2);
+  g_ptr_array_add (args, (gpointer)prg_name);
+  for (gint i = 0; i < line_argc; ++i)
+    g_ptr_array_add (args, line_argv[i]);
+  g_ptr_array_add (args, NULL);
+  int argc = args->len - 1;
+  char **argv = (char **)args->pdata;
+
+  const gchar *global_opt = find_global_option (argc, argv);
+  if (global_opt != NULL)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "Global option %s cannot be used in a command, pass it to the shell", global_opt);
+      return FALSE;
+    }
+
+  const gchar *subcmd_name;
+  gboolean with_subcmds;
+  const gchar *cmd_name = get_command (&argc, argv);
+  PeasPluginInfo *plug = find_command_plugin (cmds, cmd_name, &argc, argv, &subcmd_name, &with_subcmds);
+  PeasExtension *exten = load_command (cmds, plug);
+  if (exten == NULL)
+    {
+      if (cmd_name == NULL)
+        g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED, "No command specified");
+      else
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown command: '%s'", cmd_name);
+      return FALSE;
+    }
+
+  g_autoptr(GArray) repos_enabled = save_repos_enabled (ctx);
+  dnf_state_reset (dnf_context_get_state (ctx));
+  dl_pkgs_printed = FALSE;
+  gboolean ret = run_command (plug, exten, ctx, argc, argv, error);
+  restore_repos_enabled (ctx, repos_enabled);
+  return ret;
+}
+
+static gboolean
+run_shell (CommandsInfo  *cmds,
+           DnfContext    *ctx,
+           int            argc,
+           char          *argv[],
+           GError       **error)
+{
+  g_autoptr(GOptionContext) opt_ctx = g_option_context_new ("shell [FILE] - Run commands from FILE or stdin against one loaded sack");
+  g_option_context_set_description (opt_ctx, "One command per line, e.g. \"install PACKAGE\". Empty lines and lines "
+                                             "starting with '#' are ignored. Processing stops at the first failed command. "
+                                             "Global options apply to all the commands and are given to the shell itself. "
+                                             "--assumeyes or --assumeno is required when the commands are read from stdin.");
+  g_option_context_add_group (opt_ctx, new_global_opt_group (ctx));
+  if (!g_option_context_parse (opt_ctx, &argc, &argv, error))
+    return FALSE;
+
+  if (argc > 2)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_UNKNOWN_OPTION, "Unknown argument %s", argv[2]);
+      return FALSE;
+    }
+
+  g_autoptr(GIOChannel) input = NULL;
+  if (argc == 2 && g_strcmp0 (argv[1], "-") != 0)
+    input = g_io_channel_new_file (argv[1], "r", error);
+  else
+    {
+      /* The confirmation prompt reads its answer from stdin, it would consume the commands. */
+      enum DnfConfPriority priority;
+      if (!dnf_utils_conf_main_get_bool_opt ("assumeyes", &priority) &&
+          !dnf_utils_conf_main_get_bool_opt ("assumeno", &priority))
+        {
+          g_set_error_literal (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                               "The \"--assumeyes\" or \"--assumeno\" argument must be used "
+                               "when the commands are read from stdin");
+          return FALSE;
+        }
+      input = g_io_channel_unix_new (STDIN_FILENO);
+    }
+  if (input == NULL)
+    return FALSE;
+
+  g_autofree gchar *rpmdb_cookie = NULL;
+  if (!setup_preloaded_sack (ctx, &rpmdb_cookie, error))
+    return FALSE;
+
+  guint line_number = 0;
+  while (TRUE)
+    {
+      g_autofree gchar *line = NULL;
+      GIOStatus status = g_io_channel_read_line (input, &line, NULL, NULL, error);
+      if (status == G_IO_STATUS_EOF)
+        break;
+      if (status != G_IO_STATUS_NORMAL)
+        return FALSE;
+      ++line_number;
+
+      g_strstrip (line);
+      if (line[0] == '\0' || line[0] == '#')
+        continue;
+
+      DnfSack *sack = dnf_context_get_sack (ctx);
+      if (!run_shell_line (cmds, ctx, argv[0], line, error))
+        {
+          if (error && *error)
+            g_prefix_error (error, "line %u: ", line_number);
+          return FALSE;
+        }
+
+      /* Reload the sack after a transaction, after a command which set up its own sack
+       * or left requests in the goal (e.g. a declined transaction). */
+      g_autofree gchar *new_rpmdb_cookie = dnf_utils_get_rpmdb_cookie (ctx);
+      if (dnf_context_get_sack (ctx) != sack ||
+          g_strcmp0 (new_rpmdb_cookie, rpmdb_cookie) != 0 ||
+          hy_goal_req_length (dnf_context_get_goal (ctx)) > 0)
+        {
+          if (!setup_preloaded_sack (ctx, &rpmdb_cookie, error))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -391,14 +927,65 @@ main (int   argc,
   g_autoptr(PeasEngine) engine = peas_engine_get_default ();
   g_autoptr(PeasExtensionSet) cmd_exts = NULL;
   g_autoptr(GOptionContext) opt_ctx = g_option_context_new ("COMMAND");
-  g_autoptr(GOptionContext) subcmd_opt_ctx = NULL;
-  g_autofree gchar *subcmd_opt_param = NULL;
   GSList *cmds_with_subcmds = NULL;  /* list of commands with subcommands */
   /* dictionary of aliases for commands */
   g_autoptr(GHashTable) cmds_aliases = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
 
   setlocale (LC_ALL, "");
 
+  /* Is help, timings or daemon option in arguments? */
+  gboolean use_daemon = FALSE;
+  const gchar *daemon_socket = DNF_DAEMON_DEFAULT_SOCKET;
+  g_autoptr(GPtrArray) daemon_args = g_ptr_array_new ();
+  g_ptr_array_add (daemon_args, argv[0]);
+  for (gint in = 1; in < argc; in++)
+    {
+      if (g_strcmp0 (argv[in], "--") == 0)
+        {
+          for (; in < argc; in++)
+            g_ptr_array_add (daemon_args, argv[in]);
+          break;
+        }
+      /* The daemon options are not forwarded to the daemon. */
+      if (g_strcmp0 (argv[in], "--use-daemon") == 0)
+        {
+          use_daemon = TRUE;
+          continue;
+        }
+      if (g_str_has_prefix (argv[in], "--daemon-socket="))
+        {
+          daemon_socket = argv[in] + strlen ("--daemon-socket=");
+          continue;
+        }
+      if (g_strcmp0 (argv[in], "--daemon-socket") == 0 && in + 1 < argc)
+        {
+          daemon_socket = argv[++in];
+          continue;
+        }
+      g_ptr_array_add (daemon_args, argv[in]);
+      /* Timings must be enabled before the plugin discovery, the global options are parsed later. */
+      if (g_strcmp0 (argv[in], "--timings") == 0)
+        {
+          dnf_utils_timings_enable ();
+          continue;
+        }
+      if (g_strcmp0 (argv[in], "-h") == 0 ||
+          g_strcmp0 (argv[in], "--help") == 0 ||
+          g_strcmp0 (argv[in], "--help-all") == 0 ||
+          g_strcmp0 (argv[in], "--help-global") == 0)
+        {
+          show_help = TRUE;
+        }
+    }
+
+  /* Forward the command to the daemon. It is run locally if the daemon does not serve it. */
+  gint daemon_exit_status;
+  if (use_daemon && !show_help &&
+      dnf_daemon_client_run (daemon_socket, daemon_args->len, (gchar **)daemon_args->pdata, &daemon_exit_status))
+    return daemon_exit_status;
+
+  dnf_utils_timings_phase ("plugin discovery");
+
   if (g_getenv ("DNF_IN_TREE_PLUGINS") != NULL)
     peas_engine_prepend_search_path (engine,
                                     BUILDDIR"/plugins",
@@ -424,77 +1011,90 @@ main (int   argc,
                                      DNF_TYPE_COMMAND,
                                      NULL);
 
-  GString *cmd_summary = g_string_new ("Commands:");
-  for (const GList *plugin = peas_engine_get_plugin_list (engine);
-       plugin != NULL;
-       plugin = plugin->next)
-    {
-      PeasPluginInfo *info = plugin->data;
-      if (!peas_engine_load_plugin (engine, info))
-        continue;
-      if (peas_engine_provides_extension (engine, info, DNF_TYPE_COMMAND))
-        {
-          g_autofree gchar *command_name = g_strdup (peas_plugin_info_get_name (info));
-          g_autofree gchar *command_alias_name = g_strdup (peas_plugin_info_get_external_data (info, "Alias-Name"));
+  /* Only the plugin metadata is read here. Plugins are loaded on demand. */
+  scan_commands (engine, cmds_aliases, &cmds_with_subcmds);
+  CommandsInfo cmds = { engine, cmd_exts, cmds_aliases, cmds_with_subcmds };
+  g_option_context_set_ignore_unknown_options (opt_ctx, TRUE);
+  g_option_context_set_help_enabled (opt_ctx, FALSE);
+  g_option_context_set_main_group (opt_ctx, new_global_opt_group (ctx));
 
-          /* Plugins with a '_' character in command name implement subcommands.
-             E.g. the "command_module_enable" plugin implements the "enable" subcommand of the "module" command. */
-          for (gchar *ptr = command_name; *ptr != '\0'; ++ptr)
-            {
-              if (*ptr == '_')
-                {
-                  *ptr = ' ';
-                  cmds_with_subcmds = g_slist_append (cmds_with_subcmds, g_strndup (command_name, ptr - command_name));
-                  break;
-                }
-            }
+  /*
+   * Parse the global options.
+   */
+  if (!g_option_context_parse (opt_ctx, &argc, &argv, &error))
+    goto out;
 
-          /* Add command alias to the dictionary. */
-          if (command_alias_name)
-              g_hash_table_insert (cmds_aliases, g_strdup (command_alias_name), g_strdup (command_name));
+  const gchar *cmd_name = get_command (&argc, argv);
 
-          /*
-           * At least 2 spaces between the command and its description are needed
-           * so that help2man formats it correctly.
-           */
-          g_string_append_printf (cmd_summary, "\n  %-16s     %s", command_name, peas_plugin_info_get_description (info));
+  g_option_context_set_help_enabled (opt_ctx, TRUE);
 
-          /* If command has an alias with a description, add it to the help. */
-          const gchar *command_alias_description = peas_plugin_info_get_external_data (info, "Alias-Description");
-          if (command_alias_name && command_alias_description)
-            g_string_append_printf (cmd_summary, "\n  %-16s     %s", command_alias_name, command_alias_description);
-        }
+  if (cmd_name == NULL && show_help)
+    {
+      const char *prg_name = strrchr(argv[0], '/');
+      prg_name = prg_name ? prg_name + 1 : argv[0];
+
+      g_set_prgname (prg_name);
+      g_autofree gchar *cmd_summary = get_commands_summary (engine);
+      g_option_context_set_summary (opt_ctx, cmd_summary);
+      g_autofree gchar *help = g_option_context_get_help (opt_ctx, TRUE, NULL);
+      g_print ("%s", help);
+      goto out;
     }
-  g_option_context_set_summary (opt_ctx, cmd_summary->str);
-  g_string_free (cmd_summary, TRUE);
-  g_option_context_set_ignore_unknown_options (opt_ctx, TRUE);
-  g_option_context_set_help_enabled (opt_ctx, FALSE);
-  g_option_context_set_main_group (opt_ctx, new_global_opt_group (ctx));
 
-  /* Is help option in arguments? */
-  for (gint in = 1; in < argc; in++)
+  const BuiltinCommand *builtin = NULL;
+  for (const BuiltinCommand *it = builtin_cmds; cmd_name && it->name; ++it)
     {
-      if (g_strcmp0 (argv[in], "--") == 0)
-        break;
-      if (g_strcmp0 (argv[in], "-h") == 0 ||
-          g_strcmp0 (argv[in], "--help") == 0 ||
-          g_strcmp0 (argv[in], "--help-all") == 0 ||
-          g_strcmp0 (argv[in], "--help-global") == 0)
+      if (strcmp (cmd_name, it->name) == 0)
         {
-          show_help = TRUE;
+          builtin = it;
           break;
         }
     }
 
-  /*
-   * Parse the global options.
-   */
-  if (!g_option_context_parse (opt_ctx, &argc, &argv, &error))
-    goto out;
+  const gchar *subcmd_name = NULL;
+  gboolean with_subcmds = FALSE;
+  PeasPluginInfo *plug = NULL;
+  PeasExtension *exten = NULL;
+  if (builtin == NULL)
+    {
+      plug = find_command_plugin (&cmds, cmd_name, &argc, argv, &subcmd_name, &with_subcmds);
+      /* Load only the plugin that implements the requested command. */
+      exten = load_command (&cmds, plug);
+    }
+  if (builtin == NULL && exten == NULL)
+    {
+      if (cmd_name == NULL)
+        error = g_error_new_literal (G_IO_ERROR,
+                                     G_IO_ERROR_FAILED,
+                                     "No command specified");
+      else if (!with_subcmds)
+        error = g_error_new (G_IO_ERROR,
+                             G_IO_ERROR_FAILED,
+                             "Unknown command: '%s'", cmd_name);
+      else if (subcmd_name)
+        error = g_error_new (G_IO_ERROR,
+                             G_IO_ERROR_FAILED,
+                             "Unknown subcommand: '%s'", subcmd_name);
+      else
+        error = g_error_new (G_IO_ERROR,
+                             G_IO_ERROR_FAILED,
+                             "Missing subcommand for command: '%s'", cmd_name);
+
+      g_autofree gchar *cmd_summary = get_commands_summary (engine);
+      g_option_context_set_summary (opt_ctx, cmd_summary);
+      g_autofree gchar *help = g_option_context_get_help (opt_ctx, TRUE, NULL);
+      g_printerr ("This is microdnf, which implements subset of `dnf'.\n"
+                  "%s", help);
+      goto out;
+    }
 
   /*
    * Initialize dnf context only if help is not requested.
+   * Only the setup stages the command declares in its plugin metadata are run.
    */
+  gboolean needs_context = builtin != NULL || plugin_needs (plug, "Needs-Context");
+  gboolean needs_repos = builtin != NULL || plugin_needs (plug, "Needs-Repos");
+  gboolean needs_transaction = builtin != NULL || plugin_needs (plug, "Needs-Transaction");
   if (!show_help)
     {
       if (installroot_used &&
@@ -523,14 +1123,23 @@ main (int   argc,
       if (opt_refresh)
        dnf_context_set_cache_age (ctx, 0);
 
-      if (!dnf_context_setup (ctx, NULL, &error))
-        goto out;
-      DnfState *state = dnf_context_get_state (ctx);
-      g_signal_connect (state, "action-changed",
-                        G_CALLBACK (state_action_changed_cb),
-                        NULL);
+      if (needs_context)
+        {
+          dnf_utils_timings_phase ("context setup");
+          if (!dnf_context_setup (ctx, NULL, &error))
+            goto out;
+          DnfState *state = dnf_context_get_state (ctx);
+          g_signal_connect (state, "action-changed",
+                            G_CALLBACK (state_action_changed_cb),
+                            NULL);
+        }
 
-      for (GSList * item = enable_disable_repos; item; item = item->next)
+      /* The repository ids are checked even for the commands which do not use
+       * the available repositories, an unknown id is an error in every command. */
+      if (needs_context && !needs_repos && enable_disable_repos != NULL)
+        g_printerr ("The \"%s\" command does not use the available repositories, "
+                    "\"--enablerepo\" and \"--disablerepo\" have no effect.\n", cmd_name);
+      for (GSList * item = enable_disable_repos; needs_context && item; item = item->next)
         {
           gchar * item_data = item->data;
           int ret;
@@ -542,18 +1151,21 @@ main (int   argc,
             goto out;
         }
 
-      /* set transaction flags, allow downgrades for all transaction types */
-      DnfTransaction *txn = dnf_context_get_transaction (ctx);
-      int flags = dnf_transaction_get_flags (txn) | DNF_TRANSACTION_FLAG_ALLOW_DOWNGRADE;
-      if (opt_nodocs)
-        flags |= DNF_TRANSACTION_FLAG_NODOCS;
-      if (opt_test)
-        flags |= DNF_TRANSACTION_FLAG_TEST;
-      dnf_transaction_set_flags (txn, flags);
-      
-      /* Disable calling dnf_goal_depsolve() during dnf_context_run().
-       * The calling is done with hardcoded parameters. We dont want it. */
-      dnf_transaction_set_dont_solve_goal(txn, TRUE);
+      if (needs_context && needs_transaction)
+        {
+          /* set transaction flags, allow downgrades for all transaction types */
+          DnfTransaction *txn = dnf_context_get_transaction (ctx);
+          int flags = dnf_transaction_get_flags (txn) | DNF_TRANSACTION_FLAG_ALLOW_DOWNGRADE;
+          if (opt_nodocs)
+            flags |= DNF_TRANSACTION_FLAG_NODOCS;
+          if (opt_test)
+            flags |= DNF_TRANSACTION_FLAG_TEST;
+          dnf_transaction_set_flags (txn, flags);
+
+          /* Disable calling dnf_goal_depsolve() during dnf_context_run().
+           * The calling is done with hardcoded parameters. We dont want it. */
+          dnf_transaction_set_dont_solve_goal(txn, TRUE);
+        }
 
       if (opt_install_weak_deps == ARG_TRUE)
         dnf_context_set_install_weak_deps (TRUE);
@@ -597,93 +1209,25 @@ main (int   argc,
         }
     }
 
-  const gchar *cmd_name = get_command (&argc, argv);
-
-  g_option_context_set_help_enabled (opt_ctx, TRUE);
-
-  if (cmd_name == NULL && show_help)
-    {
-      const char *prg_name = strrchr(argv[0], '/');
-      prg_name = prg_name ? prg_name + 1 : argv[0];
-
-      g_set_prgname (prg_name);
-      g_autofree gchar *help = g_option_context_get_help (opt_ctx, TRUE, NULL);
-      g_print ("%s", help);
-      goto out;
-    }
-
-  PeasPluginInfo *plug = NULL;
-  PeasExtension *exten = NULL;
-  const gchar *subcmd_name = NULL;
-  gboolean with_subcmds = FALSE;
-
-  /* Find the plugin that implements the command cmd_name or its subcommand.
-   * Command name (cmd_name) can not contain '_' character. It is reserved for subcomands. */
-  if (cmd_name != NULL && strchr(cmd_name, '_') == NULL)
-    {
-      const gchar *original_cmd_name = g_hash_table_lookup (cmds_aliases, cmd_name);
-      const gchar *search_cmd_name = original_cmd_name ? original_cmd_name : cmd_name;
-      with_subcmds = g_slist_find_custom (cmds_with_subcmds, search_cmd_name, compare_strings) != NULL;
-      g_autofree gchar *mod_name = g_strdup_printf ("command_%s", search_cmd_name);
-      plug = peas_engine_get_plugin_info (engine, mod_name);
-      if (plug == NULL && with_subcmds)
-        {
-          subcmd_name = get_command (&argc, argv);
-          if (subcmd_name != NULL)
-            {
-              g_autofree gchar *submod_name = g_strdup_printf ("command_%s_%s", search_cmd_name, subcmd_name);
-              plug = peas_engine_get_plugin_info (engine, submod_name);
-            }
-        }
-      if (plug != NULL)
-        exten = peas_extension_set_get_extension (cmd_exts, plug);
-    }
-  if (exten == NULL)
+  if (builtin != NULL)
     {
-      if (cmd_name == NULL)
-        error = g_error_new_literal (G_IO_ERROR,
-                                     G_IO_ERROR_FAILED,
-                                     "No command specified");
-      else if (!with_subcmds)
-        error = g_error_new (G_IO_ERROR,
-                             G_IO_ERROR_FAILED,
-                             "Unknown command: '%s'", cmd_name);
-      else if (subcmd_name)
-        error = g_error_new (G_IO_ERROR,
-                             G_IO_ERROR_FAILED,
-                             "Unknown subcommand: '%s'", subcmd_name);
-      else
-        error = g_error_new (G_IO_ERROR,
-                             G_IO_ERROR_FAILED,
-                             "Missing subcommand for command: '%s'", cmd_name);
-
-      g_autofree gchar *help = g_option_context_get_help (opt_ctx, TRUE, NULL);
-      g_printerr ("This is microdnf, which implements subset of `dnf'.\n"
-                  "%s", help);
+      dnf_utils_timings_phase ("command");
+      builtin->run (&cmds, ctx, argc, argv, &error);
       goto out;
     }
 
-  subcmd_opt_param = g_strdup_printf ("%s - %s",
-    peas_plugin_info_get_external_data (plug, "Command-Syntax"),
-    peas_plugin_info_get_description (plug));
-  subcmd_opt_ctx = g_option_context_new (subcmd_opt_param);
-  g_option_context_add_group (subcmd_opt_ctx, new_global_opt_group (ctx));
-  if (!dnf_command_run (DNF_COMMAND (exten), argc, argv, subcmd_opt_ctx, ctx, &error))
+  dnf_utils_timings_phase ("command");
+  if (!run_command (plug, exten, ctx, argc, argv, &error))
     goto out;
 
 out:
   g_slist_free_full(cmds_with_subcmds, g_free);
 
+  dnf_utils_timings_print ();
+
   if (error != NULL)
     {
-      const gchar *prefix = "";
-      const gchar *suffix = "";
-      if (isatty (1))
-        {
-          prefix = "\x1b[31m\x1b[1m"; /* red, bold */
-          suffix = "\x1b[22m\x1b[0m"; /* bold off, color reset */
-        }
-      g_printerr ("%serror: %s%s\n", prefix, suffix, error->message);
+      print_error (error);
       return EXIT_FAILURE;
     }
   return EXIT_SUCCESS;
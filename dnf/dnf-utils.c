@@ -21,12 +21,33 @@
 
 #include "dnf-utils.h"
 #include <libsmartcols.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <rpm/rpmmacro.h>
+#include <solv/pool.h>
 
 
 // transaction details columns
 enum { COL_NEVRA, COL_REPO, COL_SIZE };
 
 
+// accumulated wall-clock and CPU time of one phase
+typedef struct {
+  const gchar *name;
+  gint64 wall_usec;
+  gint64 cpu_usec;
+} TimingsPhase;
+
+static GArray *timings_phases = NULL;  /* NULL if timings are disabled */
+static gint timings_current = -1;      /* index of the running phase, -1 if none */
+static gint64 timings_wall_start;
+static gint64 timings_cpu_start;
+
+static gboolean sack_preloaded = FALSE;
+static gboolean repo_setopt_given = FALSE;
+
+
 static gint
 dnf_package_cmp_cb (DnfPackage **pkg1, DnfPackage **pkg2)
 {
@@ -253,3 +274,293 @@ dnf_utils_print_transaction (DnfContext *ctx)
 
   return TRUE;
 }
+
+
+static gint64
+timings_get_cpu_time (void)
+{
+  struct rusage usage;
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return (gint64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * G_USEC_PER_SEC +
+         usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+
+void
+dnf_utils_timings_enable (void)
+{
+  if (timings_phases == NULL)
+    timings_phases = g_array_new (FALSE, FALSE, sizeof (TimingsPhase));
+}
+
+
+/* Ends the running phase and starts the "phase" one. The time spent in a phase which is
+ * entered repeatedly is accumulated. "phase" must be a static string; NULL only ends
+ * the running phase. Does nothing if timings are not enabled. */
+void
+dnf_utils_timings_phase (const gchar *phase)
+{
+  if (timings_phases == NULL)
+    return;
+
+  gint64 wall_now = g_get_monotonic_time ();
+  gint64 cpu_now = timings_get_cpu_time ();
+
+  if (timings_current >= 0)
+    {
+      TimingsPhase *current = &g_array_index (timings_phases, TimingsPhase, timings_current);
+      if (g_strcmp0 (current->name, phase) == 0)
+        return;
+      current->wall_usec += wall_now - timings_wall_start;
+      current->cpu_usec += cpu_now - timings_cpu_start;
+      timings_current = -1;
+    }
+
+  if (phase == NULL)
+    return;
+
+  for (guint i = 0; i < timings_phases->len; ++i)
+    {
+      if (g_strcmp0 (g_array_index (timings_phases, TimingsPhase, i).name, phase) == 0)
+        {
+          timings_current = i;
+          break;
+        }
+    }
+  if (timings_current < 0)
+    {
+      TimingsPhase new_phase = { phase, 0, 0 };
+      g_array_append_val (timings_phases, new_phase);
+      timings_current = timings_phases->len - 1;
+    }
+
+  timings_wall_start = wall_now;
+  timings_cpu_start = cpu_now;
+}
+
+
+/* Prints the per-phase report to stderr so that the regular output is not affected. */
+void
+dnf_utils_timings_print (void)
+{
+  if (timings_phases == NULL)
+    return;
+
+  dnf_utils_timings_phase (NULL);
+
+  gint64 wall_total = 0;
+  gint64 cpu_total = 0;
+  g_printerr ("Timings:\n");
+  g_printerr (" %-24s %12s %12s\n", "Phase", "Wall [s]", "CPU [s]");
+  for (guint i = 0; i < timings_phases->len; ++i)
+    {
+      const TimingsPhase *phase = &g_array_index (timings_phases, TimingsPhase, i);
+      g_printerr (" %-24s %12.3f %12.3f\n", phase->name,
+                  (gdouble)phase->wall_usec / G_USEC_PER_SEC, (gdouble)phase->cpu_usec / G_USEC_PER_SEC);
+      wall_total += phase->wall_usec;
+      cpu_total += phase->cpu_usec;
+    }
+  g_printerr (" %-24s %12.3f %12.3f\n", "Total",
+              (gdouble)wall_total / G_USEC_PER_SEC, (gdouble)cpu_total / G_USEC_PER_SEC);
+
+  g_array_unref (timings_phases);
+  timings_phases = NULL;
+}
+
+
+/* Returns a checksum of the rpmdb database file metadata (name, size, modification time, inode).
+ * It changes with every modification of the rpmdb. Like libdnf for the @System repo checksum,
+ * only the database file itself is used, the sqlite -shm/-wal files and the rpm lock change
+ * on read-only access too. Returns NULL if the rpmdb cannot be read.
+ * The rpm configuration must be already loaded (done by dnf_context_setup). */
+gchar *
+dnf_utils_get_rpmdb_cookie (DnfContext *ctx)
+{
+  // the database files of the sqlite, ndb and bdb rpmdb backends
+  const gchar *db_names[] = { "rpmdb.sqlite", "Packages.db", "Packages" };
+
+  char *dbpath = rpmExpand ("%{_dbpath}", NULL);
+  g_autofree gchar *rpmdb_dir = g_build_filename (dnf_context_get_install_root (ctx), dbpath, NULL);
+  free (dbpath);
+
+  for (guint i = 0; i < G_N_ELEMENTS (db_names); ++i)
+    {
+      g_autofree gchar *path = g_build_filename (rpmdb_dir, db_names[i], NULL);
+      struct stat st;
+      if (stat (path, &st) != 0)
+        continue;
+      g_autofree gchar *record = g_strdup_printf ("%s:%" G_GINT64_FORMAT ":%" G_GINT64_FORMAT ".%09ld:%" G_GUINT64_FORMAT,
+                                                  db_names[i], (gint64)st.st_size, (gint64)st.st_mtim.tv_sec,
+                                                  (long)st.st_mtim.tv_nsec, (guint64)st.st_ino);
+      return g_compute_checksum_for_string (G_CHECKSUM_SHA256, record, -1);
+    }
+
+  return NULL;
+}
+
+
+/* Marks the sack of the context as preloaded with the installed packages and all enabled
+ * repositories (daemon mode). Commands then reuse it instead of setting up a new one. */
+void
+dnf_utils_set_sack_preloaded (gboolean preloaded)
+{
+  sack_preloaded = preloaded;
+}
+
+
+/* Records that a repository option was set on the command line (--setopt=<repoid>.<option>).
+ * libdnf applies such options without a way to read them back. */
+void
+dnf_utils_set_repo_setopt_given (void)
+{
+  repo_setopt_given = TRUE;
+}
+
+
+gboolean
+dnf_utils_get_repo_setopt_given (void)
+{
+  return repo_setopt_given;
+}
+
+
+/* Sets up the sack unless a preloaded one is available. Callers must not rely on the flags
+ * to limit the content of the sack, they must filter queries by repository instead. */
+gboolean
+dnf_utils_context_setup_sack (DnfContext                *ctx,
+                              DnfContextSetupSackFlags   flags,
+                              GError                   **error)
+{
+  if (sack_preloaded && dnf_context_get_sack (ctx) != NULL)
+    return TRUE;
+  return dnf_context_setup_sack_with_flags (ctx, dnf_context_get_state (ctx), flags, error);
+}
+
+
+static void
+packageset_free0 (gpointer pset)
+{
+  if (pset)
+    dnf_packageset_free (pset);
+}
+
+
+/* Looks up all subjects of the batch (indices into `subjects`) with one in-list query
+ * on `keyname` (HY_PKG_NAME or HY_PKG_NEVRA) and stores the matches into `result`. */
+static void
+resolve_subjects_batch (DnfSack    *sack,
+                        gchar     **subjects,
+                        GArray     *batch,
+                        int         keyname,
+                        gboolean    icase,
+                        gboolean    with_src,
+                        GPtrArray  *result)
+{
+  if (batch->len == 0)
+    return;
+
+  Pool *pool = dnf_sack_get_pool (sack);
+  gboolean fold = icase && keyname == HY_PKG_NAME;
+  g_autoptr(GPtrArray) values = g_ptr_array_sized_new (batch->len + 1);
+  for (guint i = 0; i < batch->len; ++i)
+    g_ptr_array_add (values, subjects[g_array_index (batch, guint, i)]);
+  g_ptr_array_add (values, NULL);
+
+  hy_autoquery HyQuery query = hy_query_create (sack);
+  if (!with_src)
+    hy_query_filter (query, HY_PKG_ARCH, HY_NEQ, "src");
+  // on failure the subjects stay unresolved and are solved one by one
+  if (hy_query_filter_in (query, keyname, fold ? HY_EQ | HY_ICASE : HY_EQ, (const char **) values->pdata) != 0)
+    return;
+
+  // group the matching packages by the name or NEVRA they were matched with
+  g_autoptr(GHashTable) groups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, packageset_free0);
+  DnfPackageSet *pset = hy_query_run_set (query);
+  Map *map = dnf_packageset_get_map (pset);
+  for (Id p = 2; p < pool->nsolvables; ++p)
+    {
+      if (!MAPTST (map, p))
+        continue;
+      Solvable *s = pool_id2solvable (pool, p);
+      gchar *key;
+      if (keyname == HY_PKG_NAME)
+        key = fold ? g_ascii_strdown (pool_id2str (pool, s->name), -1) : g_strdup (pool_id2str (pool, s->name));
+      else
+        key = g_strdup (pool_solvable2str (pool, s));
+      DnfPackageSet *group = g_hash_table_lookup (groups, key);
+      if (!group)
+        {
+          group = dnf_packageset_new (sack);
+          g_hash_table_insert (groups, key, group);
+        }
+      else
+        g_free (key);
+      MAPSET (dnf_packageset_get_map (group), p);
+    }
+  dnf_packageset_free (pset);
+
+  for (guint i = 0; i < batch->len; ++i)
+    {
+      guint idx = g_array_index (batch, guint, i);
+      g_autofree gchar *key = fold ? g_ascii_strdown (subjects[idx], -1) : g_strdup (subjects[idx]);
+      DnfPackageSet *group = g_hash_table_lookup (groups, key);
+      if (!group)
+        continue;
+      DnfPackageSet *match = dnf_packageset_new (sack);
+      map_or (dnf_packageset_get_map (match), dnf_packageset_get_map (group));
+      packageset_free0 (g_ptr_array_index (result, idx));
+      g_ptr_array_index (result, idx) = match;
+    }
+}
+
+
+/* Resolves many subjects at once instead of calling hy_subject_get_best_solution() for each.
+ * Plain package names and exact NEVRAs are looked up with one in-list query per kind. They
+ * match what hy_subject_get_best_solution() returns: the NEVRA form is tried first, and
+ * a subject without a dot cannot parse as the NEVRA or NA forms, so the NAME form decides.
+ * Exact NEVRAs are always compared case-sensitively.
+ * Returns an array with the matched packages for each subject. The entry is NULL when the
+ * subject must be solved by hy_subject_get_best_solution(): globs, provides, files, partial
+ * NEVRAs and anything that did not match as a whole name or NEVRA. */
+GPtrArray *
+dnf_utils_resolve_subjects (DnfSack   *sack,
+                            gchar    **subjects,
+                            gboolean   icase,
+                            gboolean   with_src)
+{
+  guint nsubjects = g_strv_length (subjects);
+  GPtrArray *result = g_ptr_array_new_full (nsubjects, packageset_free0);
+  g_autoptr(GArray) names = g_array_new (FALSE, FALSE, sizeof (guint));
+  g_autoptr(GArray) nevras = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (guint i = 0; i < nsubjects; ++i)
+    {
+      g_ptr_array_add (result, NULL);
+      if (hy_is_glob_pattern (subjects[i]))
+        continue;
+      g_array_append_val (strchr (subjects[i], '.') ? nevras : names, i);
+    }
+
+  resolve_subjects_batch (sack, subjects, names, HY_PKG_NAME, icase, with_src, result);
+  resolve_subjects_batch (sack, subjects, nevras, HY_PKG_NEVRA, icase, with_src, result);
+
+  return result;
+}
+
+
+/* Configures the librepo handle of the repository for network transfers again. Loading the
+ * metadata (dnf_repo_check, dnf_sack_add_repo) leaves the handle pointing to the local cache
+ * and libdnf has no call for restoring it. dnf_repo_download_packages() starts by resetting
+ * the handle from the repository configuration (dnf_repo_set_keyfile_data() in libdnf's
+ * dnf-repo.cpp): URLs, mirrorlist/metalink, proxy, credentials, SSL options,
+ * timeouts. With no packages nothing else is done; the destination is the repository's
+ * metadata directory, which exists, so no packages directory is created.
+ * Must be called from the thread which owns the context. */
+gboolean
+dnf_utils_repo_reset_lr_handle (DnfRepo *repo, GError **error)
+{
+  g_autoptr(GPtrArray) no_pkgs = g_ptr_array_new ();
+  g_autoptr(DnfState) state = dnf_state_new ();
+  return dnf_repo_download_packages (repo, no_pkgs, dnf_repo_get_location (repo), state, error);
+}
@@ -28,4 +28,21 @@ gboolean dnf_utils_print_transaction (DnfContext *ctx);
 gboolean dnf_utils_conf_main_get_bool_opt (const gchar *name, enum DnfConfPriority *priority);
 gboolean dnf_utils_userconfirm (void);
 
+void dnf_utils_timings_enable (void);
+void dnf_utils_timings_phase (const gchar *phase);
+void dnf_utils_timings_print (void);
+
+gchar *dnf_utils_get_rpmdb_cookie (DnfContext *ctx);
+void dnf_utils_set_sack_preloaded (gboolean preloaded);
+void dnf_utils_set_repo_setopt_given (void);
+gboolean dnf_utils_get_repo_setopt_given (void);
+gboolean dnf_utils_context_setup_sack (DnfContext                *ctx,
+                                       DnfContextSetupSackFlags   flags,
+                                       GError                   **error);
+GPtrArray *dnf_utils_resolve_subjects (DnfSack   *sack,
+                                       gchar    **subjects,
+                                       gboolean   icase,
+                                       gboolean   with_src);
+gboolean dnf_utils_repo_reset_lr_handle (DnfRepo *repo, GError **error);
+
 G_END_DECLS
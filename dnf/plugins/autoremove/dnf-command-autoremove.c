@@ -0,0 +1,284 @@
+/* dnf-command-autoremove.c
+ *
+ * Copyright © 2026 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dnf-command-autoremove.h"
+#include "dnf-depgraph.h"
+#include "dnf-utils.h"
+
+#include <sqlite3.h>
+
+struct _DnfCommandAutoremove
+{
+  PeasExtensionBase parent_instance;
+};
+
+static void dnf_command_autoremove_iface_init (DnfCommandInterface *iface);
+
+G_DEFINE_DYNAMIC_TYPE_EXTENDED (DnfCommandAutoremove,
+                                dnf_command_autoremove,
+                                PEAS_TYPE_EXTENSION_BASE,
+                                0,
+                                G_IMPLEMENT_INTERFACE (DNF_TYPE_COMMAND,
+                                                       dnf_command_autoremove_iface_init))
+
+static void
+dnf_command_autoremove_init (DnfCommandAutoremove *self)
+{
+}
+
+static void
+disable_available_repos (DnfContext *ctx)
+{
+  const GPtrArray *repos = dnf_context_get_repos (ctx);
+
+  for (guint i = 0; i < repos->len; ++i)
+    {
+      DnfRepo *repo = g_ptr_array_index (repos, i);
+      dnf_repo_set_enabled (repo, DNF_REPO_ENABLED_NONE);
+    }
+}
+
+/* The history database is private to libdnf. The queries and the values below match the
+ * schema version 1.x (libdnf/transaction/sql/create_tables.sql) and the enums in
+ * libdnf/transaction/Types.hpp as of libdnf 0.73. */
+#define HISTORY_SCHEMA_MAJOR "1."
+
+/* Values of libdnf::TransactionItemReason stored in the history database */
+#define REASON_DEPENDENCY 1
+#define REASON_CLEAN 3
+#define REASON_WEAK_DEPENDENCY 4
+
+/* Values of libdnf::TransactionState and libdnf::TransactionItemAction */
+#define TRANS_STATE_DONE 1
+#define ACTION_DOWNGRADED 3
+#define ACTION_OBSOLETED 5
+#define ACTION_UPGRADED 7
+#define ACTION_REMOVE 8
+#define ACTION_REINSTALLED 10
+
+/* Fails unless the history database uses a schema version the queries were written for.
+ * Reading an unknown schema could make every package a root, or remove the wrong ones. */
+static gboolean
+check_history_schema (sqlite3 *db, const gchar *db_path, GError **error)
+{
+  sqlite3_stmt *stmt;
+  g_autofree gchar *version = NULL;
+  if (sqlite3_prepare_v2 (db, "SELECT value FROM config WHERE key = 'version'", -1, &stmt, NULL) == SQLITE_OK)
+    {
+      if (sqlite3_step (stmt) == SQLITE_ROW)
+        version = g_strdup ((const gchar *) sqlite3_column_text (stmt, 0));
+      sqlite3_finalize (stmt);
+    }
+  if (version == NULL || !g_str_has_prefix (version, HISTORY_SCHEMA_MAJOR))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Unsupported schema version %s of history database %s",
+                   version ? version : "(unknown)", db_path);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/*
+ * Reads the reasons of the packages from the history database libdnf writes during
+ * transactions. Returns a table "name.arch" -> reason of the last successful transaction
+ * which installed or kept the package, like libdnf resolves the reason. Packages unknown
+ * to the history (e.g. installed by rpm directly) are not in the table.
+ */
+static GHashTable *
+read_package_reasons (DnfContext *ctx, GError **error)
+{
+  g_autoptr(GHashTable) reasons = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autofree gchar *persistdir = dnf_conf_main_get_option ("persistdir", NULL, NULL);
+  g_autofree gchar *db_path = g_build_filename (dnf_context_get_install_root (ctx),
+                                                persistdir ? persistdir : "/var/lib/dnf",
+                                                "history.sqlite", NULL);
+  if (!g_file_test (db_path, G_FILE_TEST_EXISTS))
+    return g_steal_pointer (&reasons);
+
+  sqlite3 *db;
+  if (sqlite3_open_v2 (db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Cannot open history database %s: %s", db_path, sqlite3_errmsg (db));
+      sqlite3_close (db);
+      return NULL;
+    }
+  if (!check_history_schema (db, db_path, error))
+    {
+      sqlite3_close (db);
+      return NULL;
+    }
+
+  // skip the outgoing sides of downgrades, obsoletes, upgrades and reinstalls
+  const char *sql =
+    "SELECT i.name, i.arch, ti.action, ti.reason "
+    "FROM trans_item ti JOIN trans t ON ti.trans_id = t.id JOIN rpm i USING (item_id) "
+    "WHERE t.state = " G_STRINGIFY (TRANS_STATE_DONE) " AND ti.action NOT IN ("
+    G_STRINGIFY (ACTION_DOWNGRADED) ", " G_STRINGIFY (ACTION_OBSOLETED) ", "
+    G_STRINGIFY (ACTION_UPGRADED) ", " G_STRINGIFY (ACTION_REINSTALLED) ") "
+    "ORDER BY ti.trans_id ASC";
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Cannot read history database %s: %s", db_path, sqlite3_errmsg (db));
+      sqlite3_close (db);
+      return NULL;
+    }
+
+  int ret;
+  while ((ret = sqlite3_step (stmt)) == SQLITE_ROW)
+    {
+      gchar *key = g_strdup_printf ("%s.%s", sqlite3_column_text (stmt, 0), sqlite3_column_text (stmt, 1));
+      // the later transactions override the earlier ones
+      if (sqlite3_column_int (stmt, 2) == ACTION_REMOVE)
+        {
+          g_hash_table_remove (reasons, key);
+          g_free (key);
+        }
+      else
+        g_hash_table_insert (reasons, key, GINT_TO_POINTER (sqlite3_column_int (stmt, 3)));
+    }
+  if (ret != SQLITE_DONE)
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Cannot read history database %s: %s", db_path, sqlite3_errmsg (db));
+
+  sqlite3_finalize (stmt);
+  sqlite3_close (db);
+  return ret == SQLITE_DONE ? g_steal_pointer (&reasons) : NULL;
+}
+
+static gboolean
+dnf_command_autoremove_run (DnfCommand      *cmd,
+                            int              argc,
+                            char            *argv[],
+                            GOptionContext  *opt_ctx,
+                            DnfContext      *ctx,
+                            GError         **error)
+{
+  if (!g_option_context_parse (opt_ctx, &argc, &argv, error))
+    return FALSE;
+
+  // only look at installed packages
+  disable_available_repos (ctx);
+  dnf_utils_timings_phase ("sack setup");
+  if (!dnf_utils_context_setup_sack (ctx, DNF_CONTEXT_SETUP_SACK_FLAG_NONE, error))
+    return FALSE;
+
+  g_autoptr(GHashTable) reasons = read_package_reasons (ctx, error);
+  if (reasons == NULL)
+    return FALSE;
+
+  // every provider of a dependency, including the pre-requires, is kept, so the removal
+  // never breaks a kept package
+  DnfSack *sack = dnf_context_get_sack (ctx);
+  g_autoptr(GPtrArray) pkgs = dnf_depgraph_get_installed_packages (sack);
+  DnfDepGraphFlags graph_flags = DNF_DEPGRAPH_FLAG_ALL_PROVIDERS | DNF_DEPGRAPH_FLAG_PREREQUIRES;
+  if (dnf_context_get_install_weak_deps ())
+    graph_flags |= DNF_DEPGRAPH_FLAG_RECOMMENDS;
+  g_autoptr(DnfDepGraph) graph = dnf_depgraph_new (sack, pkgs, graph_flags);
+
+  // the roots are the packages not installed as dependencies: installed by the user,
+  // by a group or with an unknown reason
+  const guint N = graph->nnodes;
+  g_autofree guint64 *reached = dnf_bitset_new (N);
+  g_autofree guint *queue = g_malloc (N * sizeof (*queue));
+  guint head = 0;
+  guint tail = 0;
+  for (guint i = 0; i < N; i++)
+    {
+      DnfPackage *pkg = g_ptr_array_index (pkgs, i);
+      g_autofree gchar *key = g_strdup_printf ("%s.%s", dnf_package_get_name (pkg), dnf_package_get_arch (pkg));
+      gpointer reason;
+      if (g_hash_table_lookup_extended (reasons, key, NULL, &reason) &&
+          (GPOINTER_TO_INT (reason) == REASON_DEPENDENCY ||
+           GPOINTER_TO_INT (reason) == REASON_WEAK_DEPENDENCY ||
+           GPOINTER_TO_INT (reason) == REASON_CLEAN))
+        continue;
+      dnf_bitset_set (reached, i);
+      queue[tail++] = i;
+    }
+
+  // mark everything reachable from the roots, one pass over the edges
+  while (head < tail)
+    {
+      const guint u = queue[head++];
+      for (guint e = graph->offsets[u]; e < graph->offsets[u + 1]; e++)
+        {
+          const guint v = graph->targets[e];
+          if (dnf_bitset_test (reached, v))
+            continue;
+          dnf_bitset_set (reached, v);
+          queue[tail++] = v;
+        }
+    }
+
+  if (tail == N)
+    {
+      g_print ("Nothing to do.\n");
+      return TRUE;
+    }
+
+  // remove all the unreachable packages in one transaction
+  HyGoal goal = dnf_context_get_goal (ctx);
+  for (guint i = 0; i < N; i++)
+    if (!dnf_bitset_test (reached, i))
+      hy_goal_erase (goal, g_ptr_array_index (pkgs, i));
+
+  dnf_utils_timings_phase ("depsolve");
+  if (!dnf_goal_depsolve (goal, DNF_ERASE, error))
+    return FALSE;
+  dnf_utils_timings_phase ("confirmation");
+  if (!dnf_utils_print_transaction (ctx))
+    return TRUE;
+  if (!dnf_utils_userconfirm ())
+    return FALSE;
+  dnf_utils_timings_phase ("transaction");
+  if (!dnf_context_run (ctx, NULL, error))
+    return FALSE;
+  g_print ("Complete.\n");
+
+  return TRUE;
+}
+
+static void
+dnf_command_autoremove_class_init (DnfCommandAutoremoveClass *klass)
+{
+}
+
+static void
+dnf_command_autoremove_iface_init (DnfCommandInterface *iface)
+{
+  iface->run = dnf_command_autoremove_run;
+}
+
+static void
+dnf_command_autoremove_class_finalize (DnfCommandAutoremoveClass *klass)
+{
+}
+
+G_MODULE_EXPORT void
+dnf_command_autoremove_register_types (PeasObjectModule *module)
+{
+  dnf_command_autoremove_register_type (G_TYPE_MODULE (module));
+
+  peas_object_module_register_extension_type (module,
+                                              DNF_TYPE_COMMAND,
+                                              DNF_TYPE_COMMAND_AUTOREMOVE);
+}
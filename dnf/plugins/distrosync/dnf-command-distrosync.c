@@ -56,6 +56,10 @@ dnf_command_distrosync_run (DnfCommand      *cmd,
   if (!g_option_context_parse (opt_ctx, &argc, &argv, error))
     return FALSE;
 
+  dnf_utils_timings_phase ("sack setup");
+  if (!dnf_utils_context_setup_sack (ctx, DNF_CONTEXT_SETUP_SACK_FLAG_NONE, error))
+    return FALSE;
+  dnf_utils_timings_phase ("subject resolution");
   if (pkgs == NULL)
     {
       if (!dnf_context_distrosync_all (ctx, error))
@@ -77,12 +81,15 @@ dnf_command_distrosync_run (DnfCommand      *cmd,
     }
   if (!dnf_context_get_install_weak_deps ())
     flags |= DNF_IGNORE_WEAK_DEPS;
+  dnf_utils_timings_phase ("depsolve");
   if (!dnf_goal_depsolve (dnf_context_get_goal (ctx), flags, error))
     return FALSE;
+  dnf_utils_timings_phase ("confirmation");
   if (!dnf_utils_print_transaction (ctx))
     return TRUE;
   if (!dnf_utils_userconfirm ())
     return FALSE;
+  dnf_utils_timings_phase ("transaction");
   if (!dnf_context_run (ctx, NULL, error))
     return FALSE;
   g_print ("Complete.\n");
@@ -17,9 +17,21 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* For copy_file_range */
+#define _GNU_SOURCE
+
 #include "dnf-command-download.h"
 #include "dnf-utils.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <librepo/librepo.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
 /* For MAXPATHLEN */
 #include <sys/param.h>
 
@@ -180,138 +192,526 @@ gptrarr_dnf_package_repopkgcmp (gconstpointer a, gconstpointer b)
   return repocmp;
 }
 
-/* Compare packages by repository priority and cost */
-static gint
-dnf_package_repo_prio_cost_cmp (gconstpointer pkg1, gconstpointer pkg2, gpointer repo_loader)
+typedef struct
 {
-  const gchar *pkg1_reponame = dnf_package_get_reponame ((DnfPackage*)pkg1);
-  const gchar *pkg2_reponame = dnf_package_get_reponame ((DnfPackage*)pkg2);
-  if (strcmp (pkg1_reponame, pkg2_reponame) == 0)
-    return 0;
-
-  DnfRepo *pkg1_repo = dnf_repo_loader_get_repo_by_id (repo_loader, pkg1_reponame, NULL);
-  DnfRepo *pkg2_repo = dnf_repo_loader_get_repo_by_id (repo_loader, pkg2_reponame, NULL);
+  int priority;
+  int cost;
+} RepoPrioCost;
 
-  // A higher value means a lower repository priority.
-  int result = (pkg2_repo ? hy_repo_get_priority (dnf_repo_get_repo (pkg2_repo)) : INT_MAX) -
-               (pkg1_repo ? hy_repo_get_priority (dnf_repo_get_repo (pkg1_repo)) : INT_MAX);
-
-  if (result == 0)
-    result = (pkg1_repo ? hy_repo_get_cost (dnf_repo_get_repo (pkg1_repo)) : INT_MAX) -
-             (pkg2_repo ? hy_repo_get_cost (dnf_repo_get_repo (pkg2_repo)) : INT_MAX);
+/* Returns the priority and cost of the repository. The values are looked up once per repository
+ * and cached in the "repo_prio_cost" table. */
+static const RepoPrioCost *
+get_repo_prio_cost (GHashTable *repo_prio_cost, DnfRepoLoader *repo_loader, const gchar *reponame)
+{
+  RepoPrioCost *prio_cost = g_hash_table_lookup (repo_prio_cost, reponame);
+  if (prio_cost == NULL)
+    {
+      DnfRepo *repo = dnf_repo_loader_get_repo_by_id (repo_loader, reponame, NULL);
+      prio_cost = g_new (RepoPrioCost, 1);
+      prio_cost->priority = repo ? hy_repo_get_priority (dnf_repo_get_repo (repo)) : INT_MAX;
+      prio_cost->cost = repo ? hy_repo_get_cost (dnf_repo_get_repo (repo)) : INT_MAX;
+      // the repository name is owned by the sack, it outlives the table
+      g_hash_table_insert (repo_prio_cost, (gpointer)reponame, prio_cost);
+    }
+  return prio_cost;
+}
 
-  return result;
+/* Returns TRUE if a package from the repository "a" is preferred over a package from "b" or if they
+ * are equal. The repository with the greater priority value is preferred (unlike in dnf, where
+ * a lower value wins), then the one with the lower cost. This keeps the selection of the previous
+ * implementation: repositories that cannot be found get the INT_MAX priority and rank first. */
+static gboolean
+repo_prio_cost_preferred (const RepoPrioCost *a, const RepoPrioCost *b)
+{
+  if (a->priority != b->priority)
+    return a->priority > b->priority;
+  return a->cost <= b->cost;
 }
 
+typedef struct
+{
+  DnfPackage *pkg;
+  const RepoPrioCost *prio_cost;
+} NevraCandidate;
+
 /* The "pkgs" array can contain multiple packages with the same NEVRA.
- * The function selects one (from the cheapest repository with the highest priority) package for each NEVRA. */
+ * The function selects one (from the cheapest repository with the greatest priority value) package for each NEVRA. */
 static GPtrArray *
 select_one_pkg_for_nevra (DnfRepoLoader *repo_loader, GPtrArray *pkgs)
 {
-  g_autoptr(GHashTable) nevra2pkgs = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GHashTable) repo_prio_cost = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+  g_autoptr(GHashTable) nevra2candidate = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
   for (guint i = 0 ; i < pkgs->len; ++i)
     {
       DnfPackage *pkg = g_ptr_array_index (pkgs, i);
       const gchar *pkg_nevra = dnf_package_get_nevra (pkg);
-      g_hash_table_insert (nevra2pkgs, (gpointer)pkg_nevra, g_slist_prepend (g_hash_table_lookup (nevra2pkgs, pkg_nevra), pkg));
+      const RepoPrioCost *prio_cost = get_repo_prio_cost (repo_prio_cost, repo_loader,
+                                                          dnf_package_get_reponame (pkg));
+      NevraCandidate *candidate = g_hash_table_lookup (nevra2candidate, pkg_nevra);
+      if (candidate == NULL)
+        {
+          candidate = g_new (NevraCandidate, 1);
+          candidate->pkg = pkg;
+          candidate->prio_cost = prio_cost;
+          g_hash_table_insert (nevra2candidate, (gpointer)pkg_nevra, candidate);
+        }
+      else if (repo_prio_cost_preferred (prio_cost, candidate->prio_cost))
+        {
+          candidate->pkg = pkg;
+          candidate->prio_cost = prio_cost;
+        }
     }
 
-  g_autoptr(GPtrArray) pkgs_to_download = g_ptr_array_sized_new (g_hash_table_size (nevra2pkgs));
+  g_autoptr(GPtrArray) pkgs_to_download = g_ptr_array_sized_new (g_hash_table_size (nevra2candidate));
   GHashTableIter iter;
-  GSList *pkgs_list;
-  g_hash_table_iter_init (&iter, nevra2pkgs);
-  while (g_hash_table_iter_next (&iter, NULL, (gpointer)&pkgs_list))
-    {
-      pkgs_list = g_slist_sort_with_data (pkgs_list, dnf_package_repo_prio_cost_cmp, repo_loader);
-      g_ptr_array_add (pkgs_to_download, pkgs_list->data);
-      g_slist_free (pkgs_list);
-    }
+  NevraCandidate *candidate;
+  g_hash_table_iter_init (&iter, nevra2candidate);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer)&candidate))
+    g_ptr_array_add (pkgs_to_download, candidate->pkg);
 
   return g_steal_pointer (&pkgs_to_download);
 }
 
+/* Returns the path of the downloaded package in the "directory". librepo names the file
+ * by the basename of the package location. */
+static gchar *
+get_download_path (DnfPackage *pkg, const gchar *directory)
+{
+  g_autofree gchar *basename = g_path_get_basename (dnf_package_get_location (pkg));
+  return g_build_filename (directory, basename, NULL);
+}
+
+/* Returns TRUE if the file exists and its checksum matches the checksum of the package. */
 static gboolean
-download_packages (DnfRepoLoader *repo_loader, GPtrArray *pkgs, DnfState *state, GError **error)
+file_matches_package_checksum (const gchar *path, DnfPackage *pkg)
 {
-  g_autoptr(GPtrArray) pkgs_to_download = select_one_pkg_for_nevra (repo_loader, pkgs);
+  int chksum_type;
+  const unsigned char *chksum = dnf_package_get_chksum (pkg, &chksum_type);
+  if (chksum == NULL)
+    return FALSE;
 
-  g_ptr_array_sort (pkgs_to_download, gptrarr_dnf_package_repopkgcmp);
-  rpmKeyring keyring = rpmKeyringNew ();
-  GError *error_local = NULL;
-  gchar prev_repo[MAXPATHLEN];
-  prev_repo[0] = '\0';
-  for (guint i = 0 ; i < pkgs_to_download->len; ++i)
-    {
-      DnfPackage * pkg = g_ptr_array_index (pkgs_to_download, i);
-      const gchar * pkg_nevra = dnf_package_get_nevra (pkg);
+  const gchar *chksum_name = hy_chksum_name (chksum_type);
+  GChecksumType g_chksum_type;
+  if (g_strcmp0 (chksum_name, "md5") == 0)
+    g_chksum_type = G_CHECKSUM_MD5;
+  else if (g_strcmp0 (chksum_name, "sha1") == 0)
+    g_chksum_type = G_CHECKSUM_SHA1;
+  else if (g_strcmp0 (chksum_name, "sha256") == 0)
+    g_chksum_type = G_CHECKSUM_SHA256;
+  else if (g_strcmp0 (chksum_name, "sha384") == 0)
+    g_chksum_type = G_CHECKSUM_SHA384;
+  else if (g_strcmp0 (chksum_name, "sha512") == 0)
+    g_chksum_type = G_CHECKSUM_SHA512;
+  else
+    return FALSE;
 
-      const gchar * reponame = dnf_package_get_reponame (pkg);
-      if (strlen (reponame) >= MAXPATHLEN)
-        {
-          g_error ("Reponame exceeds max path len (%s)\n", reponame);
-          return FALSE;
-        }
-      DnfRepo * repo = dnf_repo_loader_get_repo_by_id (repo_loader, reponame, error);
-      if (*error != 0)
+  FILE *file = fopen (path, "rbe");
+  if (file == NULL)
+    return FALSE;
+  g_autoptr(GChecksum) checksum = g_checksum_new (g_chksum_type);
+  guchar buf[65536];
+  size_t len;
+  while ((len = fread (buf, 1, sizeof (buf), file)) > 0)
+    g_checksum_update (checksum, buf, len);
+  gboolean read_error = ferror (file);
+  fclose (file);
+  if (read_error)
+    return FALSE;
+
+  g_autofree gchar *expected = hy_chksum_str (chksum, chksum_type);
+  return g_strcmp0 (g_checksum_get_string (checksum), expected) == 0;
+}
+
+static gboolean
+copy_file_data (int src_fd, int dst_fd)
+{
+  ssize_t ret;
+  while ((ret = copy_file_range (src_fd, NULL, dst_fd, NULL, 1024 * 1024 * 1024, 0)) > 0)
+    ;
+  if (ret == 0)
+    return TRUE;
+  if (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+    return FALSE;
+
+  // copy_file_range is not supported between these files, copy the data by hand
+  if (lseek (src_fd, 0, SEEK_SET) < 0 || lseek (dst_fd, 0, SEEK_SET) < 0 || ftruncate (dst_fd, 0) < 0)
+    return FALSE;
+  gchar buf[65536];
+  while ((ret = read (src_fd, buf, sizeof (buf))) != 0)
+    {
+      if (ret < 0)
         {
-          g_print ("Failed to find repo(%s)\n", reponame);
+          if (errno == EINTR)
+            continue;
           return FALSE;
         }
-      // Add repo keys to keyring if this is the first time we see the repo
-      if (prev_repo[0] == '\0' || strcmp (prev_repo, reponame) != 0)
+      for (ssize_t written = 0; written < ret; )
         {
-          g_auto(GStrv) pubkeys = dnf_repo_get_public_keys (repo);
-          if (*pubkeys)
+          ssize_t w = write (dst_fd, buf + written, ret - written);
+          if (w < 0)
             {
-              for (char **iter = pubkeys; iter && *iter; iter++)
-                {
-                  const char *pubkey = *iter;
-                  if (!dnf_keyring_add_public_key (keyring, pubkey, error))
-                    {
-                      return FALSE;
-                    }
-                }
+              if (errno == EINTR)
+                continue;
+              return FALSE;
             }
-          strcpy (prev_repo, reponame);
+          written += w;
         }
-      dnf_package_set_repo (pkg, repo);
-      const gchar *download_path = dnf_package_download (pkg, "./", state, error);
-      if (*error != 0)
+    }
+  return TRUE;
+}
+
+/* Places the file "src" to "dst". The file is reflinked if the filesystem supports it,
+ * hardlinked if not and copied as the last resort. */
+static gboolean
+place_cached_file (const gchar *src, const gchar *dst, GError **error)
+{
+  int src_fd = open (src, O_RDONLY | O_CLOEXEC);
+  if (src_fd < 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                   "Cannot open %s: %s", src, g_strerror (errno));
+      return FALSE;
+    }
+
+  unlink (dst);
+  int dst_fd = open (dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (dst_fd >= 0 && ioctl (dst_fd, FICLONE, src_fd) == 0)
+    {
+      close (dst_fd);
+      close (src_fd);
+      return TRUE;
+    }
+  if (dst_fd >= 0)
+    {
+      close (dst_fd);
+      unlink (dst);
+    }
+
+  if (link (src, dst) == 0)
+    {
+      close (src_fd);
+      return TRUE;
+    }
+
+  dst_fd = open (dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (dst_fd < 0 || !copy_file_data (src_fd, dst_fd))
+    {
+      int saved_errno = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (saved_errno),
+                   "Cannot copy %s to %s: %s", src, dst, g_strerror (saved_errno));
+      if (dst_fd >= 0)
         {
-          g_print ("Failed to download %s\n", pkg_nevra);
-          return FALSE;
+          close (dst_fd);
+          unlink (dst);
         }
+      close (src_fd);
+      return FALSE;
+    }
+  close (dst_fd);
+  close (src_fd);
+  return TRUE;
+}
+
+/* Tries to reuse an identical file instead of downloading the package. Returns TRUE if the file
+ * with the matching checksum is already in the destination directory or if it was placed there
+ * from the local package cache. */
+static gboolean
+reuse_existing_package (DnfPackage *pkg, const gchar *directory)
+{
+  g_autofree gchar *download_path = get_download_path (pkg, directory);
+  if (file_matches_package_checksum (download_path, pkg))
+    {
+      g_print ("Skipped %s, already present\n", dnf_package_get_nevra (pkg));
+      return TRUE;
+    }
+
+  const gchar *cached_path = dnf_package_get_filename (pkg);
+  if (cached_path == NULL || !file_matches_package_checksum (cached_path, pkg))
+    return FALSE;
+
+  g_autoptr(GError) error_local = NULL;
+  if (!place_cached_file (cached_path, download_path, &error_local))
+    {
+      g_printerr ("Cannot reuse cached %s: %s\n", dnf_package_get_nevra (pkg), error_local->message);
+      return FALSE;
+    }
+  g_print ("Reused %s from the package cache\n", dnf_package_get_nevra (pkg));
+  return TRUE;
+}
 
-      g_print ("Downloaded %s\n", pkg_nevra);
+static gboolean
+check_package_signature (rpmKeyring keyring, gboolean gpgcheck, const gchar *repo_id, const gchar *nevra,
+                         const gchar *download_path, GError **error)
+{
+  GError *error_local = NULL;
 
-      // Check signature (if set on repo)
-      if (dnf_repo_get_gpgcheck (repo) &&
-          !dnf_keyring_check_untrusted_file (keyring, download_path, &error_local))
+  // Check signature (if set on repo)
+  if (gpgcheck &&
+      !dnf_keyring_check_untrusted_file (keyring, download_path, &error_local))
+    {
+      if (!g_error_matches (error_local, DNF_ERROR, DNF_ERROR_GPG_SIGNATURE_INVALID))
         {
-          if (!g_error_matches (error_local, DNF_ERROR, DNF_ERROR_GPG_SIGNATURE_INVALID))
-            {
-              g_set_error (error,
-                           DNF_ERROR,
-                           DNF_ERROR_FILE_INVALID,
-                           "keyring check failure on %1$s "
-                           "and repo %2$s is GPG enabled: %3$s",
-                           dnf_package_get_nevra (pkg),
-                           dnf_repo_get_id (repo),
-                           error_local->message);
-              g_error_free (error_local);
-              return FALSE;
-            }
           g_set_error (error,
                        DNF_ERROR,
                        DNF_ERROR_FILE_INVALID,
-                       "package %1$s cannot be verified "
+                       "keyring check failure on %1$s "
                        "and repo %2$s is GPG enabled: %3$s",
-                       dnf_package_get_nevra (pkg),
-                       dnf_repo_get_id (repo),
+                       nevra,
+                       repo_id,
                        error_local->message);
           g_error_free (error_local);
           return FALSE;
         }
+      g_set_error (error,
+                   DNF_ERROR,
+                   DNF_ERROR_FILE_INVALID,
+                   "package %1$s cannot be verified "
+                   "and repo %2$s is GPG enabled: %3$s",
+                   nevra,
+                   repo_id,
+                   error_local->message);
+      g_error_free (error_local);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Signatures of the downloaded packages are verified by a worker thread while the other
+ * packages are still being downloaded. rpm does not document its keyring and package reading
+ * as thread-safe, so there is a single worker and the rpm calls are never concurrent; the
+ * main thread only runs the librepo transfers. The keyring is filled before the first
+ * download. The libsolv pool is not thread-safe, the worker gets everything it needs about
+ * the package in the job. */
+typedef struct
+{
+  rpmKeyring keyring;
+  GThreadPool *pool;
+  GMutex lock;
+  GError *error;  // the first failure, the remaining jobs are skipped
+} VerifyPipeline;
+
+typedef struct
+{
+  gboolean gpgcheck;
+  const gchar *repo_id;  // owned by the repository
+  gchar *nevra;
+  gchar *download_path;
+} VerifyJob;
+
+static VerifyJob *
+verify_job_new (DnfRepo *repo, DnfPackage *pkg)
+{
+  VerifyJob *job = g_new (VerifyJob, 1);
+  job->gpgcheck = dnf_repo_get_gpgcheck (repo);
+  job->repo_id = dnf_repo_get_id (repo);
+  job->nevra = g_strdup (dnf_package_get_nevra (pkg));
+  job->download_path = get_download_path (pkg, "./");
+  return job;
+}
+
+static void
+verify_job_free (VerifyJob *job)
+{
+  g_free (job->nevra);
+  g_free (job->download_path);
+  g_free (job);
+}
+
+static gboolean
+verify_pipeline_failed (VerifyPipeline *pipeline)
+{
+  g_mutex_lock (&pipeline->lock);
+  gboolean failed = pipeline->error != NULL;
+  g_mutex_unlock (&pipeline->lock);
+  return failed;
+}
+
+static void
+verify_pipeline_set_error (VerifyPipeline *pipeline, GError *error)
+{
+  g_mutex_lock (&pipeline->lock);
+  if (pipeline->error == NULL)
+    pipeline->error = error;
+  else
+    g_error_free (error);
+  g_mutex_unlock (&pipeline->lock);
+}
+
+static void
+verify_package_worker (gpointer data, gpointer user_data)
+{
+  VerifyJob *job = data;
+  VerifyPipeline *pipeline = user_data;
+  GError *error_local = NULL;
+
+  if (!verify_pipeline_failed (pipeline) &&
+      !check_package_signature (pipeline->keyring, job->gpgcheck, job->repo_id, job->nevra,
+                                job->download_path, &error_local))
+    verify_pipeline_set_error (pipeline, error_local);
+  verify_job_free (job);
+}
+
+/* The verification job of a package, queued by librepo's end callback as soon as the download
+ * of the package finishes. librepo calls the callbacks from lr_download_packages() on the main thread. */
+typedef struct
+{
+  VerifyPipeline *pipeline;
+  VerifyJob *job;  // NULL once queued
+} DownloadTarget;
+
+static int
+package_download_end_cb (void *data, LrTransferStatus status, const char *msg)
+{
+  DownloadTarget *target = data;
+
+  if (status == LR_TRANSFER_ERROR)
+    {
+      g_print ("Failed to download %s\n", target->job->nevra);
+      return LR_CB_OK;
+    }
+
+  g_print ("Downloaded %s\n", target->job->nevra);
+  g_thread_pool_push (target->pipeline->pool, g_steal_pointer (&target->job), NULL);
+
+  // a failed signature check stops the outstanding downloads (LR_PACKAGEDOWNLOAD_FAILFAST)
+  return verify_pipeline_failed (target->pipeline) ? LR_CB_ERROR : LR_CB_OK;
+}
+
+static LrPackageTarget *
+package_target_new (DnfRepo *repo, DnfPackage *pkg, DownloadTarget *target, GError **error)
+{
+  int chksum_type;
+  const unsigned char *chksum = dnf_package_get_chksum (pkg, &chksum_type);
+  g_autofree gchar *chksum_str = chksum ? hy_chksum_str (chksum, chksum_type) : NULL;
+  LrChecksumType lr_chksum_type = chksum ? lr_checksum_type (hy_chksum_name (chksum_type)) : LR_CHECKSUM_UNKNOWN;
+
+  return lr_packagetarget_new_v2 (dnf_repo_get_lr_handle (repo), dnf_package_get_location (pkg), "./",
+                                  lr_chksum_type, chksum_str, dnf_package_get_downloadsize (pkg),
+                                  dnf_package_get_baseurl (pkg), TRUE, NULL, target,
+                                  package_download_end_cb, NULL, error);
+}
+
+/* Prepares the librepo handle of the repository for downloading packages. */
+static gboolean
+prepare_repo_handle (DnfRepo *repo, guint max_parallel, GError **error)
+{
+  if (!dnf_utils_repo_reset_lr_handle (repo, error))
+    return FALSE;
+  if (max_parallel > 0 &&
+      !lr_handle_setopt (dnf_repo_get_lr_handle (repo), error, LRO_MAXPARALLELDOWNLOADS, (long)max_parallel))
+    return FALSE;
+  return TRUE;
+}
+
+static gboolean
+download_packages (DnfRepoLoader *repo_loader, GPtrArray *pkgs, gboolean reuse_existing,
+                   guint max_parallel, GError **error)
+{
+  g_autoptr(GPtrArray) pkgs_to_download = select_one_pkg_for_nevra (repo_loader, pkgs);
+
+  g_ptr_array_sort (pkgs_to_download, gptrarr_dnf_package_repopkgcmp);
+
+  // Packages are sorted by repository, add the keys of all the repositories
+  // to the keyring up front.
+  g_autoptr(GPtrArray) pkg_repos = g_ptr_array_sized_new (pkgs_to_download->len);
+  rpmKeyring keyring = rpmKeyringNew ();
+  DnfRepo *repo = NULL;
+  for (guint i = 0; i < pkgs_to_download->len; ++i)
+    {
+      DnfPackage * pkg = g_ptr_array_index (pkgs_to_download, i);
+      const gchar * reponame = dnf_package_get_reponame (pkg);
+      if (repo == NULL || strcmp (dnf_repo_get_id (repo), reponame) != 0)
+        {
+          repo = dnf_repo_loader_get_repo_by_id (repo_loader, reponame, error);
+          if (*error != 0)
+            {
+              g_print ("Failed to find repo(%s)\n", reponame);
+              rpmKeyringFree (keyring);
+              return FALSE;
+            }
+          // Add repo keys to keyring
+          g_auto(GStrv) pubkeys = dnf_repo_get_public_keys (repo);
+          for (char **iter = pubkeys; iter && *iter; iter++)
+            {
+              const char *pubkey = *iter;
+              if (!dnf_keyring_add_public_key (keyring, pubkey, error))
+                {
+                  rpmKeyringFree (keyring);
+                  return FALSE;
+                }
+            }
+        }
+      dnf_package_set_repo (pkg, repo);
+      g_ptr_array_add (pkg_repos, repo);
+    }
+
+  VerifyPipeline pipeline = { .keyring = keyring };
+  g_mutex_init (&pipeline.lock);
+  pipeline.pool = g_thread_pool_new (verify_package_worker, &pipeline, 1, FALSE, NULL);
+
+  // the reused files are verified the same way as the downloaded ones
+  g_autoptr(GPtrArray) to_download = g_ptr_array_sized_new (pkgs_to_download->len);
+  g_autoptr(GPtrArray) to_download_repos = g_ptr_array_sized_new (pkgs_to_download->len);
+  if (reuse_existing)
+    dnf_utils_timings_phase ("reuse check");
+  for (guint i = 0; i < pkgs_to_download->len; ++i)
+    {
+      DnfPackage * pkg = g_ptr_array_index (pkgs_to_download, i);
+      DnfRepo * pkg_repo = g_ptr_array_index (pkg_repos, i);
+      if (reuse_existing && reuse_existing_package (pkg, "./"))
+        {
+          g_thread_pool_push (pipeline.pool, verify_job_new (pkg_repo, pkg), NULL);
+          continue;
+        }
+      g_ptr_array_add (to_download, pkg);
+      g_ptr_array_add (to_download_repos, pkg_repo);
+    }
+
+  // librepo downloads the packages of all the repositories in parallel (up to max_parallel_downloads)
+  // and stops the outstanding downloads on the first failure. Every package is queued
+  // for verification as soon as its download finishes.
+  if (to_download->len > 0)
+    {
+      dnf_utils_timings_phase ("package download");
+      g_autofree DownloadTarget *targets = g_new0 (DownloadTarget, to_download->len);
+      GSList *lr_targets = NULL;
+      GError *error_local = NULL;
+      for (guint i = 0; i < to_download->len && error_local == NULL; ++i)
+        {
+          DnfPackage * pkg = g_ptr_array_index (to_download, i);
+          DnfRepo * pkg_repo = g_ptr_array_index (to_download_repos, i);
+          if ((i == 0 || pkg_repo != g_ptr_array_index (to_download_repos, i - 1)) &&
+              !prepare_repo_handle (pkg_repo, max_parallel, &error_local))
+            break;
+          targets[i].pipeline = &pipeline;
+          targets[i].job = verify_job_new (pkg_repo, pkg);
+          LrPackageTarget *lr_target = package_target_new (pkg_repo, pkg, &targets[i], &error_local);
+          if (lr_target != NULL)
+            lr_targets = g_slist_prepend (lr_targets, lr_target);
+        }
+      lr_targets = g_slist_reverse (lr_targets);
+
+      if (error_local == NULL)
+        lr_download_packages (lr_targets, LR_PACKAGEDOWNLOAD_FAILFAST, &error_local);
+      if (error_local != NULL)
+        verify_pipeline_set_error (&pipeline, error_local);
+
+      g_slist_free_full (lr_targets, (GDestroyNotify)lr_packagetarget_free);
+      for (guint i = 0; i < to_download->len; ++i)
+        if (targets[i].job != NULL)
+          verify_job_free (targets[i].job);
+    }
+
+  // wait for the verification of the already downloaded packages
+  dnf_utils_timings_phase ("gpg check");
+  g_thread_pool_free (pipeline.pool, FALSE, TRUE);
+  g_mutex_clear (&pipeline.lock);
+  rpmKeyringFree (keyring);
+
+  if (pipeline.error != NULL)
+    {
+      g_propagate_error (error, pipeline.error);
+      return FALSE;
     }
   return TRUE;
 }
@@ -355,30 +755,210 @@ get_packages_query (DnfContext *ctx, GStrv pkgs_spec, gboolean opt_src, const gc
   return g_steal_pointer (&query);
 }
 
-static GPtrArray *
-get_packages_deps (DnfContext *ctx, GPtrArray *packages, GError **error)
+static void
+append_package_ids (GArray *ids, GPtrArray *pkgs)
 {
-  DnfSack *sack = dnf_context_get_sack (ctx);
+  for (guint i = 0; i < pkgs->len; ++i)
+    {
+      Id id = dnf_package_get_id (g_ptr_array_index (pkgs, i));
+      g_array_append_val (ids, id);
+    }
+  g_ptr_array_unref (pkgs);
+}
 
-  g_autoptr(GPtrArray) deps = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+/* Runs the goal and appends the solvable ids of the packages to install or upgrade to "ids". */
+static gboolean
+run_deps_goal (HyGoal goal, GArray *ids)
+{
+  if (hy_goal_run_flags (goal, DNF_NONE) != 0)
+    return FALSE;
+  append_package_ids (ids, hy_goal_list_installs (goal, NULL));
+  append_package_ids (ids, hy_goal_list_upgrades (goal, NULL));
+  return TRUE;
+}
 
-  for (guint i = 0; i < packages->len; ++i)
+/* Resolves each of the packages with indexes start, start + step, ... in its own goal. */
+static gboolean
+resolve_isolated_deps (DnfSack *sack, GPtrArray *packages, guint start, guint step, GArray *ids)
+{
+  for (guint i = start; i < packages->len; i += step)
     {
-      DnfPackage * pkg = g_ptr_array_index (packages, i);
       HyGoal goal = hy_goal_create (sack);
-      hy_goal_install (goal, pkg);
-      if (hy_goal_run_flags (goal, DNF_NONE) == 0)
+      hy_goal_install (goal, g_ptr_array_index (packages, i));
+      gboolean solved = run_deps_goal (goal, ids);
+      hy_goal_free (goal);
+      if (!solved)
+        return FALSE;
+    }
+  return TRUE;
+}
+
+static gboolean
+read_package_ids (int fd, GArray *ids)
+{
+  g_autoptr(GByteArray) data = g_byte_array_new ();
+  guint8 buf[4096];
+  while (TRUE)
+    {
+      ssize_t ret = read (fd, buf, sizeof (buf));
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret < 0)
+        return FALSE;
+      if (ret == 0)
+        break;
+      g_byte_array_append (data, buf, ret);
+    }
+  if (data->len % sizeof (Id) != 0)
+    return FALSE;
+  g_array_append_vals (ids, data->data, data->len / sizeof (Id));
+  return TRUE;
+}
+
+static gboolean
+write_package_ids (int fd, GArray *ids)
+{
+  const gchar *ptr = ids->data;
+  gsize len = ids->len * sizeof (Id);
+  while (len > 0)
+    {
+      ssize_t ret = write (fd, ptr, len);
+      if (ret < 0 && errno == EINTR)
+        continue;
+      if (ret < 0)
+        return FALSE;
+      ptr += ret;
+      len -= ret;
+    }
+  return TRUE;
+}
+
+/* Resolves each package in its own goal. The libsolv pool is not thread-safe, so the goals
+ * are solved in forked children sharing the loaded sack. Every child solves a slice of the packages
+ * and sends the solvable ids of the resolved packages back through a pipe. */
+static gboolean
+resolve_isolated_deps_parallel (DnfSack *sack, GPtrArray *packages, GArray *ids, GError **error)
+{
+  guint n_workers = MIN (g_get_num_processors (), packages->len);
+  if (n_workers <= 1)
+    {
+      if (!resolve_isolated_deps (sack, packages, 0, 1, ids))
         {
-          ptr_array_extend_and_steal (deps, hy_goal_list_installs (goal, NULL));
-          ptr_array_extend_and_steal (deps, hy_goal_list_upgrades (goal, NULL));
+          g_set_error_literal (error, DNF_ERROR, DNF_ERROR_NO_SOLUTION, "Error in resolve of packages");
+          return FALSE;
         }
-      else
+      return TRUE;
+    }
+
+  g_autofree pid_t *pids = g_new (pid_t, n_workers);
+  g_autofree int *fds = g_new (int, n_workers);
+  guint n_started = 0;
+  int fork_errno = 0;
+
+  fflush (stdout);
+  fflush (stderr);
+  for (; n_started < n_workers; ++n_started)
+    {
+      int pipe_fds[2];
+      if (pipe (pipe_fds) < 0)
+        {
+          fork_errno = errno;
+          break;
+        }
+      pid_t pid = fork ();
+      if (pid == 0)
+        {
+          close (pipe_fds[0]);
+          g_autoptr(GArray) worker_ids = g_array_new (FALSE, FALSE, sizeof (Id));
+          gboolean ok = resolve_isolated_deps (sack, packages, n_started, n_workers, worker_ids) &&
+                        write_package_ids (pipe_fds[1], worker_ids);
+          _exit (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+      close (pipe_fds[1]);
+      if (pid < 0)
+        {
+          fork_errno = errno;
+          close (pipe_fds[0]);
+          break;
+        }
+      pids[n_started] = pid;
+      fds[n_started] = pipe_fds[0];
+    }
+
+  gboolean solved = TRUE;
+  for (guint i = 0; i < n_started; ++i)
+    {
+      if (!read_package_ids (fds[i], ids))
+        solved = FALSE;
+      close (fds[i]);
+
+      int status;
+      while (waitpid (pids[i], &status, 0) < 0)
+        {
+          if (errno != EINTR)
+            {
+              status = EXIT_FAILURE;
+              break;
+            }
+        }
+      if (!WIFEXITED (status) || WEXITSTATUS (status) != EXIT_SUCCESS)
+        solved = FALSE;
+    }
+
+  if (fork_errno != 0)
+    {
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (fork_errno),
+                   "Cannot start dependency resolution: %s", g_strerror (fork_errno));
+      return FALSE;
+    }
+  if (!solved)
+    {
+      g_set_error_literal (error, DNF_ERROR, DNF_ERROR_NO_SOLUTION, "Error in resolve of packages");
+      return FALSE;
+    }
+  return TRUE;
+}
+
+/* Returns the packages needed to install the "packages" which are not already in "packages".
+ * By default all the packages are resolved in one goal. With "isolated" every package is resolved
+ * separately, so a package is not affected by conflicts with the other requested packages. */
+static GPtrArray *
+get_packages_deps (DnfContext *ctx, GPtrArray *packages, gboolean isolated, GError **error)
+{
+  DnfSack *sack = dnf_context_get_sack (ctx);
+  g_autoptr(GArray) ids = g_array_new (FALSE, FALSE, sizeof (Id));
+
+  if (isolated)
+    {
+      if (!resolve_isolated_deps_parallel (sack, packages, ids, error))
+        return NULL;
+    }
+  else
+    {
+      HyGoal goal = hy_goal_create (sack);
+      for (guint i = 0; i < packages->len; ++i)
+        hy_goal_install (goal, g_ptr_array_index (packages, i));
+      gboolean solved = run_deps_goal (goal, ids);
+      hy_goal_free (goal);
+      if (!solved)
         {
           g_set_error_literal (error, DNF_ERROR, DNF_ERROR_NO_SOLUTION, "Error in resolve of packages");
-          hy_goal_free (goal);
           return NULL;
         }
-      hy_goal_free (goal);
+    }
+
+  // the results of the isolated goals overlap, add every package only once
+  g_autoptr(GHashTable) seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (guint i = 0; i < packages->len; ++i)
+    g_hash_table_add (seen, GINT_TO_POINTER (dnf_package_get_id (g_ptr_array_index (packages, i))));
+
+  g_autoptr(GPtrArray) deps = g_ptr_array_new_with_free_func ((GDestroyNotify)g_object_unref);
+  for (guint i = 0; i < ids->len; ++i)
+    {
+      Id id = g_array_index (ids, Id, i);
+      if (!g_hash_table_add (seen, GINT_TO_POINTER (id)))
+        continue;
+      g_ptr_array_add (deps, dnf_package_new (sack, id));
     }
 
   return g_steal_pointer (&deps);
@@ -397,10 +977,16 @@ dnf_command_download_run (DnfCommand      *cmd,
   gboolean opt_src = FALSE;
   gboolean opt_resolve = FALSE;
   gboolean opt_alldeps = FALSE;
+  gboolean opt_isolated_deps = FALSE;
+  gint opt_parallel = 0;
+  gboolean opt_reuse_existing = FALSE;
   const GOptionEntry opts[] = {
     { "archlist", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &opt_archlist, "limit the query to packages of given architectures", "ARCH,..."},
     { "resolve", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_resolve, "resolve and download needed dependencies", NULL },
     { "alldeps", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_alldeps, "when running with --resolve, download all dependencies (do not exclude already installed ones)", NULL },
+    { "isolated-deps", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_isolated_deps, "when running with --resolve, resolve dependencies of each package separately", NULL },
+    { "parallel", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_INT, &opt_parallel, "download up to N packages in parallel (default: max_parallel_downloads)", "N" },
+    { "reuse-existing", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_reuse_existing, "skip packages already present in the destination and reuse files from the package cache (verified by checksum)", NULL },
     { "source", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_src, "download source packages", NULL },
     { G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_STRING_ARRAY, &opt_key, NULL, NULL },
     { NULL }
@@ -419,6 +1005,15 @@ dnf_command_download_run (DnfCommand      *cmd,
       return FALSE;
     }
 
+  if (opt_parallel < 0)
+    {
+      g_set_error (error,
+                   G_OPTION_ERROR,
+                   G_OPTION_ERROR_BAD_VALUE,
+                   "Invalid value of --parallel: %d", opt_parallel);
+      return FALSE;
+    }
+
   DnfRepoLoader * repo_loader = dnf_context_get_repo_loader (ctx);
   // If -source arg was passed, auto-enable the source repositories
   if (opt_src && !dnf_command_download_enablesourcerepos (ctx, repo_loader, error))
@@ -429,10 +1024,12 @@ dnf_command_download_run (DnfCommand      *cmd,
   DnfState * state = dnf_context_get_state (ctx);
   DnfContextSetupSackFlags sack_flags = !opt_resolve || opt_alldeps ? DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_RPMDB
                                                                     : DNF_CONTEXT_SETUP_SACK_FLAG_NONE;
+  dnf_utils_timings_phase ("sack setup");
   if (!dnf_context_setup_sack_with_flags (ctx, state, sack_flags, error)) {
       return FALSE;
   }
 
+  dnf_utils_timings_phase ("subject resolution");
   hy_autoquery HyQuery query = get_packages_query (ctx, opt_key, opt_src, opt_archlist);
 
   g_autoptr(GPtrArray) pkgs = hy_query_run (query);
@@ -445,7 +1042,8 @@ dnf_command_download_run (DnfCommand      *cmd,
 
   if (opt_resolve)
     {
-      GPtrArray *deps = get_packages_deps (ctx, pkgs, error);
+      dnf_utils_timings_phase ("depsolve");
+      GPtrArray *deps = get_packages_deps (ctx, pkgs, opt_isolated_deps, error);
       if (!deps)
         {
           return FALSE;
@@ -453,7 +1051,7 @@ dnf_command_download_run (DnfCommand      *cmd,
       ptr_array_extend_and_steal (pkgs, deps);
     }
 
-  if (!download_packages (repo_loader, pkgs, state, error))
+  if (!download_packages (repo_loader, pkgs, opt_reuse_existing, opt_parallel, error))
     {
       return FALSE;
     }
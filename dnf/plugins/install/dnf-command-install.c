@@ -67,10 +67,26 @@ dnf_command_install_run (DnfCommand      *cmd,
       return FALSE;
     }
 
-  /* Install each package */
-  for (GStrv pkg = pkgs; *pkg != NULL; pkg++)
+  dnf_utils_timings_phase ("sack setup");
+  if (!dnf_utils_context_setup_sack (ctx, DNF_CONTEXT_SETUP_SACK_FLAG_NONE, error))
+    return FALSE;
+  DnfSack *sack = dnf_context_get_sack (ctx);
+
+  /* Install each package, names and exact NEVRAs are resolved together */
+  dnf_utils_timings_phase ("subject resolution");
+  g_autoptr(GPtrArray) matches = dnf_utils_resolve_subjects (sack, pkgs, FALSE, FALSE);
+  for (guint i = 0; i < matches->len; ++i)
     {
-      if (!dnf_context_install (ctx, *pkg, error))
+      DnfPackageSet *pset = g_ptr_array_index (matches, i);
+      if (!pset)
+        {
+          if (!dnf_context_install (ctx, pkgs[i], error))
+            return FALSE;
+          continue;
+        }
+      g_auto(HySelector) selector = hy_selector_create (sack);
+      hy_selector_pkg_set (selector, HY_PKG, HY_EQ, pset);
+      if (!hy_goal_install_selector (dnf_context_get_goal (ctx), selector, error))
         return FALSE;
     }
   DnfGoalActions flags = DNF_INSTALL;
@@ -80,12 +96,15 @@ dnf_command_install_run (DnfCommand      *cmd,
     }
   if (!dnf_context_get_install_weak_deps ())
     flags |= DNF_IGNORE_WEAK_DEPS;  
+  dnf_utils_timings_phase ("depsolve");
   if (!dnf_goal_depsolve (dnf_context_get_goal (ctx), flags, error))
     return FALSE;
+  dnf_utils_timings_phase ("confirmation");
   if (!dnf_utils_print_transaction (ctx))
     return TRUE;
   if (!dnf_utils_userconfirm ())
     return FALSE;
+  dnf_utils_timings_phase ("transaction");
   if (!dnf_context_run (ctx, NULL, error))
     return FALSE;
   g_print ("Complete.\n");
@@ -17,249 +17,57 @@
  */
 
 #include "dnf-command-leaves.h"
+#include "dnf-depgraph.h"
+#include "dnf-utils.h"
 
-typedef struct {
-  guint len;
-  guint idx[];
-} IdxArray;
-
-static IdxArray *
-idx_array_new (guint len)
-{
-  return g_malloc0 (G_STRUCT_OFFSET (IdxArray, idx) + len * sizeof (guint));
-}
+#include <string.h>
 
+/* Formats the components without incoming edges from the other components. The components are
+ * ordered by their first package and the packages in a component are sorted. */
 static void
-idx_array_add (IdxArray *arr, guint idx)
-{
-  arr->idx[arr->len++] = idx;
-}
-
-static gboolean
-idx_array_from_set_iter (gpointer key, gpointer value, gpointer user_data)
-{
-  IdxArray *arr = user_data;
-  idx_array_add (arr, GPOINTER_TO_UINT (key));
-  return TRUE;
-}
-
-static gint
-idx_array_compare_func (gconstpointer a, gconstpointer b, gpointer user_data)
-{
-  guint x = *(const guint *)a;
-  guint y = *(const guint *)b;
-
-  if (x < y)
-    return -1;
-  return x > y;
-}
-
-static IdxArray *
-idx_array_copy (const guint *idx, guint len)
-{
-  IdxArray *arr = idx_array_new (len);
-  arr->len = len;
-  for (guint i = 0; i < len; i++)
-    arr->idx[i] = idx[i];
-  g_qsort_with_data (arr->idx, arr->len, sizeof (*arr->idx), idx_array_compare_func, NULL);
-  return arr;
-}
-
-static IdxArray *
-idx_array_from_set (GHashTable *set)
-{
-  IdxArray *arr = idx_array_new (g_hash_table_size (set));
-  g_hash_table_foreach_remove (set, idx_array_from_set_iter, arr);
-  g_qsort_with_data (arr->idx, arr->len, sizeof (*arr->idx), idx_array_compare_func, NULL);
-  return arr;
-}
-
-static gint
-gtree_dnf_package_cmp (gconstpointer a, gconstpointer b)
-{
-  return dnf_package_cmp ((DnfPackage *)a, (DnfPackage *)b);
-}
-
-static void
-add_edges (GHashTable *edges, HyQuery query, GTree *pkg2idx, DnfReldepList *deps)
-{
-  const gint ndeps = dnf_reldep_list_count (deps);
-
-  // resolve dependencies and add an edge if there is exactly one package satisfying it
-  for (gint j = 0; j < ndeps; j++)
-    {
-      DnfReldep *dep = dnf_reldep_list_index (deps, j);
-
-      hy_query_filter_reldep (query, HY_PKG_PROVIDES, dep);
-      g_autoptr(GPtrArray) ppkgs = hy_query_run (query);
-      hy_query_clear (query);
-      dnf_reldep_free (dep);
-
-      if (ppkgs->len != 1)
-        continue;
-
-      const DnfPackage *ppkg = g_ptr_array_index (ppkgs, 0);
-      GTreeNode *node = g_tree_lookup_node (pkg2idx, ppkg);;
-      g_assert (node);
-      g_hash_table_insert (edges, g_tree_node_value (node), NULL);
-    }
-
-  dnf_reldep_list_free (deps);
-}
-
-static GPtrArray *
-build_graph (HyQuery query, const GPtrArray *pkgs, gboolean recommends)
-{
-  // create pkg2idx to map DnfPackages to their index in pkgs
-  g_autoptr(GTree) pkg2idx = g_tree_new (gtree_dnf_package_cmp);
-  for (guint i = 0; i < pkgs->len; i++)
-    {
-      DnfPackage *pkg = g_ptr_array_index (pkgs, i);
-      g_tree_insert (pkg2idx, pkg, GUINT_TO_POINTER (i));
-    }
-
-  GPtrArray *graph = g_ptr_array_new_full (pkgs->len, g_free);
-  g_autoptr(GHashTable) edges = g_hash_table_new (g_direct_hash, g_direct_equal);
-
-  for (guint i = 0; i < pkgs->len; i++)
-    {
-      DnfPackage *pkg = g_ptr_array_index (pkgs, i);
-      add_edges (edges, query, pkg2idx, dnf_package_get_requires (pkg));
-      if (recommends)
-        add_edges (edges, query, pkg2idx, dnf_package_get_recommends (pkg));
-      g_hash_table_remove (edges, GUINT_TO_POINTER (i)); // remove self-edges
-      g_ptr_array_add (graph, idx_array_from_set (edges));
-    }
-
-  return graph;
-}
-
-static GPtrArray *
-reverse_graph (const GPtrArray *graph)
-{
-  g_autofree guint *len = g_malloc0 (graph->len * sizeof (*len));
-
-  for (guint i = 0; i < graph->len; i++)
-    {
-      const IdxArray *edges = g_ptr_array_index (graph, i);
-
-      for (guint j = 0; j < edges->len; j++)
-        len[edges->idx[j]]++;
-    }
-
-  GPtrArray *rgraph = g_ptr_array_new_full (graph->len, g_free);
-  for (guint i = 0; i < graph->len; i++)
-    g_ptr_array_add (rgraph, idx_array_new (len[i]));
-
-  for (guint i = 0; i < graph->len; i++)
-    {
-      const IdxArray *edges = g_ptr_array_index (graph, i);
-
-      for (guint j = 0; j < edges->len; j++)
-        {
-          IdxArray *redges = g_ptr_array_index (rgraph, edges->idx[j]);
-          idx_array_add (redges, i);
-        }
-    }
-
-  return rgraph;
-}
-
-static GPtrArray *
-kosaraju (const GPtrArray *graph)
-{
-  const guint N = graph->len;
-  g_autofree guint *rstack = g_malloc (N * sizeof (*rstack));
-  g_autofree guint *stack = g_malloc (N * sizeof (*stack));
-  g_autofree gboolean *tag = g_malloc0 (N * sizeof (*tag));
-  guint r = N;
-  guint top = 0;
-
-  // do depth-first searches in the graph and push nodes to rstack
-  // "on the way up" until all nodes have been pushed.
-  // tag nodes as they're processed so we don't visit them more than once
-  for (guint i = 0; i < N; i++)
-    {
-      if (tag[i])
-        continue;
-
-      guint u = i;
-      guint j = 0;
-      tag[u] = TRUE;
-      while (true)
-        {
-          const IdxArray *edges = g_ptr_array_index (graph, u);
-          if (j < edges->len)
-            {
-              const guint v = edges->idx[j++];
-              if (!tag[v])
-                {
-                  rstack[top] = j;
-                  stack[top++] = u;
-                  u = v;
-                  j = 0;
-                  tag[u] = TRUE;
-                }
-            }
-          else
-            {
-              rstack[--r] = u;
-              if (!top)
-                break;
-              u = stack[--top];
-              j = rstack[top];
-            }
-        }
-    }
-  g_assert (r == 0);
-
-  // now searches beginning at nodes popped from rstack in the graph with all
-  // edges reversed will give us the strongly connected components.
-  // this time all nodes are tagged, so let's remove the tags as we visit each
-  // node.
-  // the incoming edges to each component is the union of incoming edges to
-  // each node in the component minus the incoming edges from component nodes
-  // themselves.
-  // if there are no such incoming edges the component is a leaf and we
-  // add it to the array of leaves.
-  g_autoptr(GPtrArray) rgraph = reverse_graph (graph);
-  g_autoptr(GHashTable) sccredges = g_hash_table_new (g_direct_hash, g_direct_equal);
-  GPtrArray *leaves = g_ptr_array_new_with_free_func (g_free);
-  for (; r < N; r++)
+format_leaves (GString *out, const GPtrArray *pkgs, const DnfDepGraph *graph)
+{
+  const guint N = graph->nnodes;
+  guint ncomponents;
+  g_autofree guint *component = dnf_depgraph_find_components (graph, &ncomponents);
+
+  // mark the components with incoming edges from the other components
+  g_autofree guint64 *has_in_edges = dnf_bitset_new (ncomponents);
+  for (guint u = 0; u < N; u++)
+    for (guint e = graph->offsets[u]; e < graph->offsets[u + 1]; e++)
+      {
+        const guint v = graph->targets[e];
+        if (component[u] != component[v])
+          dnf_bitset_set (has_in_edges, component[v]);
+      }
+
+  // group the nodes by component, the nodes of every component stay sorted
+  g_autofree guint *members_offsets = g_malloc0 ((ncomponents + 1) * sizeof (*members_offsets));
+  g_autofree guint *members = g_malloc (N * sizeof (*members));
+  for (guint u = 0; u < N; u++)
+    members_offsets[component[u] + 1]++;
+  for (guint k = 0; k < ncomponents; k++)
+    members_offsets[k + 1] += members_offsets[k];
+  g_autofree guint *fill = g_malloc (ncomponents * sizeof (*fill));
+  memcpy (fill, members_offsets, ncomponents * sizeof (*fill));
+  for (guint u = 0; u < N; u++)
+    members[fill[component[u]]++] = u;
+
+  // the first node of a leaf component encountered in the node order is its first package
+  for (guint u = 0; u < N; u++)
     {
-      guint u = rstack[r];
-      if (!tag[u])
+      const guint k = component[u];
+      if (dnf_bitset_test (has_in_edges, k) || members[members_offsets[k]] != u)
         continue;
 
-      stack[top++] = u;
-      tag[u] = FALSE;
-      guint s = N;
-      while (top)
+      gchar mark = '-';
+      for (guint j = members_offsets[k]; j < members_offsets[k + 1]; j++)
         {
-          u = stack[--s] = stack[--top];
-          const IdxArray *redges = g_ptr_array_index (rgraph, u);
-          for (guint j = 0; j < redges->len; j++)
-            {
-              const guint v = redges->idx[j];
-              g_hash_table_insert (sccredges, GUINT_TO_POINTER (v), NULL);
-              if (!tag[v])
-                continue;
-
-              stack[top++] = v;
-              tag[v] = FALSE;
-            }
+          DnfPackage *pkg = g_ptr_array_index (pkgs, members[j]);
+          g_string_append_printf (out, "%c %s\n", mark, dnf_package_get_nevra (pkg));
+          mark = ' ';
         }
-
-      for (guint i = s; i < N; i++)
-        g_hash_table_remove (sccredges, GUINT_TO_POINTER (stack[i]));
-
-      if (g_hash_table_size (sccredges) == 0)
-        g_ptr_array_add (leaves, idx_array_copy (&stack[s], N - s));
-      else
-        g_hash_table_remove_all (sccredges);
     }
-
-  return leaves;
 }
 
 struct _DnfCommandLeaves
@@ -293,25 +101,39 @@ disable_available_repos (DnfContext *ctx)
     }
 }
 
-static gint
-gptrarr_dnf_package_cmp (gconstpointer a, gconstpointer b)
+/* The result is cached in the cache directory. The first line of the cache file is the key,
+ * the result depends only on the installed packages and on install_weak_deps. */
+#define LEAVES_CACHE_FILENAME "leaves.cache"
+#define LEAVES_CACHE_VERSION 1
+
+static gchar *
+get_cache_key (DnfContext *ctx)
 {
-  DnfPackage *const *x = a;
-  DnfPackage *const *y = b;
-  return dnf_package_cmp (*x, *y);
+  g_autofree gchar *rpmdb_cookie = dnf_utils_get_rpmdb_cookie (ctx);
+  if (rpmdb_cookie == NULL)
+    return NULL;
+  return g_strdup_printf ("leaves %d rpmdb=%s install_weak_deps=%d\n", LEAVES_CACHE_VERSION,
+                          rpmdb_cookie, dnf_context_get_install_weak_deps () ? 1 : 0);
+}
+
+static gboolean
+print_cached_leaves (const gchar *cache_path, const gchar *cache_key)
+{
+  g_autofree gchar *contents = NULL;
+  if (!g_file_get_contents (cache_path, &contents, NULL, NULL) ||
+      !g_str_has_prefix (contents, cache_key))
+    return FALSE;
+
+  g_print ("%s", contents + strlen (cache_key));
+  return TRUE;
 }
 
-static gint
-gptrarr_first_package_cmp (gconstpointer a, gconstpointer b)
+static void
+save_cached_leaves (const gchar *cache_path, const gchar *cache_key, const gchar *leaves)
 {
-  IdxArray *const *x = a;
-  IdxArray *const *y = b;
-  guint i = (*x)->idx[0];
-  guint j = (*y)->idx[0];
-
-  if (i < j)
-    return -1;
-  return i > j;
+  g_autofree gchar *contents = g_strconcat (cache_key, leaves, NULL);
+  // the cache is optional, e.g. a user without write access to the cache directory just does not get it
+  g_file_set_contents (cache_path, contents, -1, NULL);
 }
 
 static gboolean
@@ -325,42 +147,36 @@ dnf_command_leaves_run (DnfCommand      *cmd,
   if (!g_option_context_parse (opt_ctx, &argc, &argv, error))
     return FALSE;
 
+  // print the cached result if the installed packages did not change
+  g_autofree gchar *cache_key = get_cache_key (ctx);
+  g_autofree gchar *cache_path = g_build_filename (dnf_context_get_cache_dir (ctx), LEAVES_CACHE_FILENAME, NULL);
+  if (cache_key && print_cached_leaves (cache_path, cache_key))
+    return TRUE;
+
   // only look at installed packages
   disable_available_repos (ctx);
-  if (!dnf_context_setup_sack_with_flags (ctx,
-                                          dnf_context_get_state (ctx),
-                                          DNF_CONTEXT_SETUP_SACK_FLAG_NONE,
-                                          error)) {
+  dnf_utils_timings_phase ("sack setup");
+  if (!dnf_utils_context_setup_sack (ctx, DNF_CONTEXT_SETUP_SACK_FLAG_NONE, error)) {
 
       return FALSE;
   }
 
   // get a sorted array of all installed packages
-  hy_autoquery HyQuery query = hy_query_create (dnf_context_get_sack (ctx));
-  g_autoptr(GPtrArray) pkgs = hy_query_run (query);
-  g_ptr_array_sort (pkgs, gptrarr_dnf_package_cmp);
+  DnfSack *sack = dnf_context_get_sack (ctx);
+  g_autoptr(GPtrArray) pkgs = dnf_depgraph_get_installed_packages (sack);
 
   // build the directed graph of dependencies
-  g_autoptr(GPtrArray) graph = build_graph (query, pkgs, dnf_context_get_install_weak_deps ());
+  DnfDepGraphFlags graph_flags = dnf_context_get_install_weak_deps () ? DNF_DEPGRAPH_FLAG_RECOMMENDS
+                                                                      : DNF_DEPGRAPH_FLAG_NONE;
+  g_autoptr(DnfDepGraph) graph = dnf_depgraph_new (sack, pkgs, graph_flags);
 
-  // run Kosaraju's algorithm to find strongly connected components
-  // withhout any incoming edges
-  g_autoptr(GPtrArray) leaves = kosaraju (graph);
-  g_ptr_array_sort (leaves, gptrarr_first_package_cmp);
+  // find strongly connected components without any incoming edges
+  g_autoptr(GString) leaves = g_string_new (NULL);
+  format_leaves (leaves, pkgs, graph);
+  g_print ("%s", leaves->str);
 
-  // print the packages grouped by their components
-  for (guint i = 0; i < leaves->len; i++)
-    {
-      const IdxArray *scc = g_ptr_array_index (leaves, i);
-      gchar mark = '-';
-
-      for (guint j = 0; j < scc->len; j++)
-        {
-          DnfPackage *pkg = g_ptr_array_index (pkgs, scc->idx[j]);
-          g_print ("%c %s\n", mark, dnf_package_get_nevra (pkg));
-          mark = ' ';
-        }
-    }
+  if (cache_key)
+    save_cached_leaves (cache_path, cache_key, leaves->str);
 
   return TRUE;
 }
@@ -17,6 +17,19 @@
  */
 
 #include "dnf-command-makecache.h"
+#include "dnf-utils.h"
+
+#include <curl/curl.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <librepo/librepo.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zck.h>
+
+// group of the per-repo file with the HTTP validators of the cached repomd.xml
+#define REPOMD_STATE_GROUP "repomd"
 
 struct _DnfCommandMakecache
 {
@@ -37,6 +50,620 @@ dnf_command_makecache_init (DnfCommandMakecache *self)
 {
 }
 
+/* The conditional repomd.xml request, made with the transfer options libdnf configured
+ * on the librepo handle of the repository. */
+typedef struct
+{
+  gchar *url;  // repomd.xml on the first baseurl
+  gchar *user_agent;
+  long sslverifypeer;
+  long sslverifyhost;
+  gchar *sslcacert;
+  gchar *sslclientcert;
+  gchar *sslclientkey;
+  long lowspeedtime;   // libdnf uses the "timeout" option for the connect timeout too
+  long lowspeedlimit;  // the "minrate" option
+} RepomdRequest;
+
+static void
+repomd_request_free (RepomdRequest *request)
+{
+  g_free (request->url);
+  g_free (request->user_agent);
+  g_free (request->sslcacert);
+  g_free (request->sslclientcert);
+  g_free (request->sslclientkey);
+  g_free (request);
+}
+
+/* State of refreshing the cache of one repository. The worker threads only use the copies
+ * of the repository's id and location, the request and the HyRepo, never the DnfRepo. */
+typedef struct
+{
+  DnfRepo *repo;
+  HyRepo hrepo;
+  gchar *id;
+  gchar *location;
+  RepomdRequest *request;  // NULL if the conditional request cannot be made
+  GError *error;
+  gboolean expired;     // the cached metadata was older than the cache age
+  gboolean current;     // the server reported the cached repomd.xml as current
+  gboolean refreshed;   // the metadata was downloaded again
+  guint64 downloaded;   // bytes received from the server
+  gdouble repomd_ttfb;  // seconds from the start of the conditional repomd.xml request to its
+                        // first byte, negative if the request was not made
+  gint64 fetch_usec;    // checking, revalidating and downloading the metadata
+  gint64 convert_usec;  // loading the metadata and writing the solv cache
+  guint packages;
+  guint64 solv_size;    // size of the solv and solvx files
+  guint64 zck_total;    // compressed size of the zchunk metadata fetched by the refresh
+  guint64 zck_reused;   // part of zck_total reused from the previously cached files
+} RepoCache;
+
+static void
+repo_cache_clear (gpointer data)
+{
+  RepoCache *repo_cache = data;
+  g_free (repo_cache->id);
+  g_free (repo_cache->location);
+  g_clear_pointer (&repo_cache->request, repomd_request_free);
+  g_clear_error (&repo_cache->error);
+}
+
+/* Adds the chunks of a zchunk file to `chunks` (digest -> compressed size).
+ * Returns the size of the file as fetched from a server: its header plus all chunks. */
+static guint64
+read_zck_chunks (const gchar *path, GHashTable *chunks)
+{
+  guint64 size = 0;
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+
+  zckCtx *zck = zck_create ();
+  if (zck && zck_init_read (zck, fd))
+    {
+      size = zck_get_header_length (zck);
+      for (zckChunk *chunk = zck_get_first_chunk (zck); chunk; chunk = zck_get_next_chunk (chunk))
+        {
+          char *digest = zck_get_chunk_digest (chunk);
+          ssize_t chunk_size = zck_get_chunk_comp_size (chunk);
+          if (digest && chunk_size > 0)
+            {
+              g_hash_table_insert (chunks, g_strdup (digest), GSIZE_TO_POINTER (chunk_size));
+              size += chunk_size;
+            }
+          free (digest);
+        }
+    }
+  zck_free (&zck);
+  close (fd);
+  return size;
+}
+
+/* Returns the names of the metadata files in the cache of the repository, the chunks of
+ * zchunk files are added to `chunks` if not NULL. The file names contain the checksum
+ * of the content, a refresh that changed a file gives it a new name. */
+static GHashTable *
+get_metadata_files (DnfRepo *repo, GHashTable *chunks)
+{
+  GHashTable *files = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autofree gchar *repodata = g_build_filename (dnf_repo_get_location (repo), "repodata", NULL);
+  g_autoptr(GDir) dir = g_dir_open (repodata, 0, NULL);
+  if (!dir)
+    return files;
+
+  for (const gchar *name = g_dir_read_name (dir); name; name = g_dir_read_name (dir))
+    {
+      g_hash_table_add (files, g_strdup (name));
+      if (chunks && g_str_has_suffix (name, ".zck"))
+        {
+          g_autofree gchar *path = g_build_filename (repodata, name, NULL);
+          read_zck_chunks (path, chunks);
+        }
+    }
+  return files;
+}
+
+/* Compares the metadata files in the cache with the ones that were there before the refresh.
+ * New files were downloaded, except the chunks of zchunk files found in the old files,
+ * which were copied locally. repomd.xml keeps its name and is always downloaded. */
+static void
+compute_download_stats (RepoCache *repo_cache, GHashTable *old_files, GHashTable *old_chunks)
+{
+  g_autoptr(GHashTable) files = get_metadata_files (repo_cache->repo, NULL);
+  g_autofree gchar *repodata = g_build_filename (dnf_repo_get_location (repo_cache->repo), "repodata", NULL);
+  GHashTableIter iter;
+  gpointer name;
+
+  g_hash_table_iter_init (&iter, files);
+  while (g_hash_table_iter_next (&iter, &name, NULL))
+    {
+      g_autofree gchar *path = g_build_filename (repodata, name, NULL);
+      if (!g_str_has_suffix (name, ".zck"))
+        {
+          GStatBuf st;
+          if ((!g_hash_table_contains (old_files, name) || strcmp (name, "repomd.xml") == 0) &&
+              g_stat (path, &st) == 0)
+            repo_cache->downloaded += st.st_size;
+          continue;
+        }
+      if (g_hash_table_contains (old_files, name))
+        continue;
+
+      g_autoptr(GHashTable) chunks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      guint64 total = read_zck_chunks (path, chunks);
+      guint64 reused = 0;
+
+      GHashTableIter chunk_iter;
+      gpointer digest, size;
+      g_hash_table_iter_init (&chunk_iter, chunks);
+      while (g_hash_table_iter_next (&chunk_iter, &digest, &size))
+        if (g_hash_table_contains (old_chunks, digest))
+          reused += GPOINTER_TO_SIZE (size);
+      repo_cache->zck_total += total;
+      repo_cache->zck_reused += reused;
+      repo_cache->downloaded += total - reused;
+    }
+}
+
+// the solv cache of a repository: <id>.solv and the <id>-<kind>.solvx extensions
+static guint64
+get_solv_size (const gchar *solv_dir, const gchar *repo_id)
+{
+  const gchar *suffixes[] = { ".solv", "-filenames.solvx", "-presto.solvx", "-updateinfo.solvx", "-other.solvx" };
+  guint64 size = 0;
+
+  for (guint i = 0; i < G_N_ELEMENTS (suffixes); ++i)
+    {
+      g_autofree gchar *name = g_strconcat (repo_id, suffixes[i], NULL);
+      g_autofree gchar *path = g_build_filename (solv_dir, name, NULL);
+      GStatBuf st;
+      if (g_stat (path, &st) == 0)
+        size += st.st_size;
+    }
+  return size;
+}
+
+typedef struct
+{
+  const gchar *solv_dir;
+  const gchar *cache_dir;
+  const gchar *install_root;
+  guint cache_age;
+  gboolean revalidate;  // make conditional repomd.xml requests for the expired repositories
+} MakecacheParams;
+
+typedef struct
+{
+  GByteArray *body;
+  gchar *etag;
+  gchar *last_modified;
+} HttpResponse;
+
+static size_t
+http_write_cb (char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+  HttpResponse *response = userdata;
+  g_byte_array_append (response->body, (const guint8 *) ptr, size * nmemb);
+  return size * nmemb;
+}
+
+static size_t
+http_header_cb (char *buffer, size_t size, size_t nitems, void *userdata)
+{
+  HttpResponse *response = userdata;
+  g_autofree gchar *line = g_strstrip (g_strndup (buffer, size * nitems));
+
+  // a redirect starts a new response, only the headers of the last one matter
+  if (g_str_has_prefix (line, "HTTP/"))
+    {
+      g_clear_pointer (&response->etag, g_free);
+      g_clear_pointer (&response->last_modified, g_free);
+    }
+  else if (g_ascii_strncasecmp (line, "ETag:", 5) == 0)
+    {
+      g_free (response->etag);
+      response->etag = g_strdup (g_strchug (line + 5));
+    }
+  else if (g_ascii_strncasecmp (line, "Last-Modified:", 14) == 0)
+    {
+      g_free (response->last_modified);
+      response->last_modified = g_strdup (g_strchug (line + 14));
+    }
+  return size * nitems;
+}
+
+/* GETs the repomd.xml of the request with If-None-Match/If-Modified-Since headers made
+ * from the given validators. Returns the HTTP status code, 0 if the request failed. */
+static long
+http_get_conditional (const RepomdRequest *request,
+                      const gchar         *etag,
+                      const gchar         *last_modified,
+                      HttpResponse        *response,
+                      gdouble             *ttfb)
+{
+  CURL *curl = curl_easy_init ();
+  if (!curl)
+    return 0;
+
+  struct curl_slist *headers = NULL;
+  if (etag)
+    {
+      g_autofree gchar *header = g_strdup_printf ("If-None-Match: %s", etag);
+      headers = curl_slist_append (headers, header);
+    }
+  if (last_modified)
+    {
+      g_autofree gchar *header = g_strdup_printf ("If-Modified-Since: %s", last_modified);
+      headers = curl_slist_append (headers, header);
+    }
+
+  curl_easy_setopt (curl, CURLOPT_URL, request->url);
+  curl_easy_setopt (curl, CURLOPT_HTTPHEADER, headers);
+  curl_easy_setopt (curl, CURLOPT_USERAGENT, request->user_agent ? request->user_agent : "microdnf");
+  curl_easy_setopt (curl, CURLOPT_SSL_VERIFYPEER, request->sslverifypeer);
+  curl_easy_setopt (curl, CURLOPT_SSL_VERIFYHOST, request->sslverifyhost ? 2L : 0L);
+  if (request->sslcacert)
+    curl_easy_setopt (curl, CURLOPT_CAINFO, request->sslcacert);
+  if (request->sslclientcert)
+    curl_easy_setopt (curl, CURLOPT_SSLCERT, request->sslclientcert);
+  if (request->sslclientkey)
+    curl_easy_setopt (curl, CURLOPT_SSLKEY, request->sslclientkey);
+  curl_easy_setopt (curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt (curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt (curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt (curl, CURLOPT_CONNECTTIMEOUT, request->lowspeedtime);
+  curl_easy_setopt (curl, CURLOPT_LOW_SPEED_TIME, request->lowspeedtime);
+  curl_easy_setopt (curl, CURLOPT_LOW_SPEED_LIMIT, request->lowspeedlimit);
+  curl_easy_setopt (curl, CURLOPT_WRITEFUNCTION, http_write_cb);
+  curl_easy_setopt (curl, CURLOPT_WRITEDATA, response);
+  curl_easy_setopt (curl, CURLOPT_HEADERFUNCTION, http_header_cb);
+  curl_easy_setopt (curl, CURLOPT_HEADERDATA, response);
+
+  long status = 0;
+  if (curl_easy_perform (curl) == CURLE_OK)
+    {
+      curl_easy_getinfo (curl, CURLINFO_RESPONSE_CODE, &status);
+      curl_easy_getinfo (curl, CURLINFO_STARTTRANSFER_TIME, ttfb);
+    }
+
+  curl_slist_free_all (headers);
+  curl_easy_cleanup (curl);
+  return status;
+}
+
+/* librepo keeps the proxy and the credentials in the handle without a way to read them back.
+ * Returns TRUE if the repository may use any of them, the request could not carry them.
+ * Only the presence of the options is checked, their values come from libdnf. */
+static gboolean
+repo_has_proxy_or_credentials (DnfRepo *repo)
+{
+  const gchar *keys[] = { "proxy", "proxy_username", "proxy_password", "username", "password" };
+  g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+
+  // the repository options from the command line cannot be inspected at all
+  if (dnf_utils_get_repo_setopt_given ())
+    return TRUE;
+  if (!dnf_repo_get_filename (repo) ||
+      !g_key_file_load_from_file (keyfile, dnf_repo_get_filename (repo), G_KEY_FILE_NONE, NULL))
+    return TRUE;
+  for (guint i = 0; i < G_N_ELEMENTS (keys); ++i)
+    {
+      g_autofree gchar *value = dnf_conf_main_get_option (keys[i], NULL, NULL);
+      if ((value && *value) || g_key_file_has_key (keyfile, dnf_repo_get_id (repo), keys[i], NULL))
+        return TRUE;
+    }
+  return FALSE;
+}
+
+/* Makes the request for the repomd.xml on the first HTTP(S) baseurl of the repository from
+ * its librepo handle. Returns NULL for repositories using a metalink or mirrorlist, or with
+ * options the request cannot carry over; the regular refresh handles those. */
+static RepomdRequest *
+repomd_request_new (DnfRepo *repo)
+{
+  if (repo_has_proxy_or_credentials (repo))
+    return NULL;
+
+  // checking the cache leaves the handle pointing to the local metadata
+  if (!dnf_utils_repo_reset_lr_handle (repo, NULL))
+    return NULL;
+
+  LrHandle *handle = dnf_repo_get_lr_handle (repo);
+  gchar *mirrorlist = NULL;
+  gchar *metalink = NULL;
+  g_auto(GStrv) urls = NULL;
+  LrUrlVars *varsub = NULL;
+  if (!lr_handle_getinfo (handle, NULL, LRI_MIRRORLISTURL, &mirrorlist) ||
+      !lr_handle_getinfo (handle, NULL, LRI_METALINKURL, &metalink) ||
+      !lr_handle_getinfo (handle, NULL, LRI_URLS, &urls) ||
+      !lr_handle_getinfo (handle, NULL, LRI_VARSUB, &varsub))
+    return NULL;
+  if (mirrorlist || metalink || !urls || !urls[0])
+    return NULL;
+  if (!(g_str_has_prefix (urls[0], "http://") || g_str_has_prefix (urls[0], "https://")))
+    return NULL;
+
+  g_autofree gchar *url = lr_url_substitute (urls[0], varsub);
+  if (!url || strchr (url, '$'))
+    return NULL;
+
+  // the strings are owned by the handle, the request keeps copies for the worker threads
+  RepomdRequest *request = g_new0 (RepomdRequest, 1);
+  const gchar *user_agent = NULL;
+  const gchar *sslcacert = NULL;
+  const gchar *sslclientcert = NULL;
+  const gchar *sslclientkey = NULL;
+  if (!lr_handle_getinfo (handle, NULL, LRI_USERAGENT, &user_agent) ||
+      !lr_handle_getinfo (handle, NULL, LRI_SSLVERIFYPEER, &request->sslverifypeer) ||
+      !lr_handle_getinfo (handle, NULL, LRI_SSLVERIFYHOST, &request->sslverifyhost) ||
+      !lr_handle_getinfo (handle, NULL, LRI_SSLCACERT, &sslcacert) ||
+      !lr_handle_getinfo (handle, NULL, LRI_SSLCLIENTCERT, &sslclientcert) ||
+      !lr_handle_getinfo (handle, NULL, LRI_SSLCLIENTKEY, &sslclientkey) ||
+      !lr_handle_getinfo (handle, NULL, LRI_LOWSPEEDTIME, &request->lowspeedtime) ||
+      !lr_handle_getinfo (handle, NULL, LRI_LOWSPEEDLIMIT, &request->lowspeedlimit))
+    {
+      repomd_request_free (request);
+      return NULL;
+    }
+  request->url = g_strconcat (url, g_str_has_suffix (url, "/") ? "" : "/", "repodata/repomd.xml", NULL);
+  request->user_agent = g_strdup (user_agent);
+  request->sslcacert = g_strdup (sslcacert);
+  request->sslclientcert = g_strdup (sslclientcert);
+  request->sslclientkey = g_strdup (sslclientkey);
+  return request;
+}
+
+static gchar *
+compute_file_checksum (const gchar *path)
+{
+  g_autofree gchar *data = NULL;
+  gsize len;
+  if (!g_file_get_contents (path, &data, &len, NULL))
+    return NULL;
+  return g_compute_checksum_for_data (G_CHECKSUM_SHA256, (const guchar *) data, len);
+}
+
+// renews the cache age of the repository: libdnf measures it from the metadata files mtime
+static void
+bump_repo_expiry (const gchar *location)
+{
+  g_autofree gchar *repodata = g_build_filename (location, "repodata", NULL);
+  g_autoptr(GDir) dir = g_dir_open (repodata, 0, NULL);
+  if (!dir)
+    return;
+  for (const gchar *name = g_dir_read_name (dir); name; name = g_dir_read_name (dir))
+    {
+      g_autofree gchar *path = g_build_filename (repodata, name, NULL);
+      g_utime (path, NULL);
+    }
+}
+
+/* Asks the server whether repomd.xml changed since it was cached, using the ETag and
+ * Last-Modified values stored with the checksum of the cached file. A repomd.xml that
+ * did not change only gets its expiry bumped, the metadata and solv cache stay as they are.
+ * Returns TRUE if the cached metadata is current. */
+static gboolean
+refresh_repo_conditional (RepoCache *repo_cache, const MakecacheParams *params)
+{
+  g_autofree gchar *repomd_path = g_build_filename (repo_cache->location, "repodata", "repomd.xml", NULL);
+  g_autofree gchar *local_checksum = compute_file_checksum (repomd_path);
+  if (!local_checksum)
+    return FALSE;
+
+  g_autofree gchar *state_name = g_strconcat (repo_cache->id, "-repomd.state", NULL);
+  g_autofree gchar *state_path = g_build_filename (params->cache_dir, state_name, NULL);
+  g_autoptr(GKeyFile) repomd_state = g_key_file_new ();
+  g_autofree gchar *etag = NULL;
+  g_autofree gchar *last_modified = NULL;
+  if (g_key_file_load_from_file (repomd_state, state_path, G_KEY_FILE_NONE, NULL))
+    {
+      g_autofree gchar *checksum = g_key_file_get_string (repomd_state, REPOMD_STATE_GROUP, "checksum", NULL);
+      // the validators belong to the repomd.xml they were received with
+      if (g_strcmp0 (checksum, local_checksum) == 0)
+        {
+          etag = g_key_file_get_string (repomd_state, REPOMD_STATE_GROUP, "etag", NULL);
+          last_modified = g_key_file_get_string (repomd_state, REPOMD_STATE_GROUP, "last_modified", NULL);
+        }
+    }
+
+  HttpResponse response = { .body = g_byte_array_new () };
+  long status = http_get_conditional (repo_cache->request, etag, last_modified, &response, &repo_cache->repomd_ttfb);
+  repo_cache->downloaded += response.body->len;
+  gboolean current = FALSE;
+  g_autofree gchar *checksum = NULL;
+  if (status == 304)
+    {
+      current = TRUE;
+      checksum = g_strdup (local_checksum);
+    }
+  else if (status == 200)
+    {
+      checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256, response.body->data, response.body->len);
+      current = strcmp (checksum, local_checksum) == 0;
+    }
+
+  if (checksum)
+    {
+      g_autoptr(GKeyFile) new_state = g_key_file_new ();
+      const gchar *new_etag = response.etag ? response.etag : etag;
+      const gchar *new_last_modified = response.last_modified ? response.last_modified : last_modified;
+      g_key_file_set_string (new_state, REPOMD_STATE_GROUP, "checksum", checksum);
+      if (new_etag)
+        g_key_file_set_string (new_state, REPOMD_STATE_GROUP, "etag", new_etag);
+      if (new_last_modified)
+        g_key_file_set_string (new_state, REPOMD_STATE_GROUP, "last_modified", new_last_modified);
+      g_key_file_save_to_file (new_state, state_path, NULL);
+    }
+
+  if (current)
+    bump_repo_expiry (repo_cache->location);
+
+  g_byte_array_unref (response.body);
+  g_free (response.etag);
+  g_free (response.last_modified);
+  return current;
+}
+
+/* Checks the age of the cached metadata and prepares the conditional request of expired
+ * repositories. libdnf and librepo are only called from the main thread: the DnfRepo objects
+ * belong to the context, and libdnf's configuration and librepo's gpgme use are not
+ * documented as thread-safe. */
+static void
+check_repo_cache (RepoCache *repo_cache, const MakecacheParams *params)
+{
+  g_autoptr(DnfState) state = dnf_state_new ();
+  gint64 start = g_get_monotonic_time ();
+
+  repo_cache->id = g_strdup (dnf_repo_get_id (repo_cache->repo));
+  repo_cache->location = g_strdup (dnf_repo_get_location (repo_cache->repo));
+  repo_cache->repomd_ttfb = -1;
+  repo_cache->expired = !dnf_repo_check (repo_cache->repo, params->cache_age, state, NULL);
+  if (repo_cache->expired && params->revalidate)
+    repo_cache->request = repomd_request_new (repo_cache->repo);
+  repo_cache->fetch_usec += g_get_monotonic_time () - start;
+}
+
+/* Revalidates the cached repomd.xml with a conditional request. Only plain libcurl and
+ * the files of the repository are used, the requests of all repositories run in parallel. */
+static void
+revalidate_repo_cache_worker (gpointer data, gpointer user_data)
+{
+  RepoCache *repo_cache = data;
+  const MakecacheParams *params = user_data;
+  gint64 start = g_get_monotonic_time ();
+
+  repo_cache->current = refresh_repo_conditional (repo_cache, params);
+  repo_cache->fetch_usec += g_get_monotonic_time () - start;
+}
+
+/* Downloads the metadata of an expired repository that the server did not report as current,
+ * then loads the current metadata. One repository at a time, librepo downloads the metadata
+ * files of the repository in parallel. */
+static void
+update_repo_cache (RepoCache *repo_cache, const MakecacheParams *params)
+{
+  g_autoptr(DnfState) update_state = dnf_state_new ();
+  g_autoptr(DnfState) check_state = dnf_state_new ();
+  gint64 start = g_get_monotonic_time ();
+
+  if (!repo_cache->current)
+    {
+      // remember the cached files, the refresh replaces the whole cache directory
+      g_autoptr(GHashTable) old_chunks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      g_autoptr(GHashTable) old_files = get_metadata_files (repo_cache->repo, old_chunks);
+      repo_cache->refreshed = dnf_repo_update (repo_cache->repo, DNF_REPO_UPDATE_FLAG_FORCE,
+                                               update_state, &repo_cache->error);
+      if (repo_cache->refreshed)
+        compute_download_stats (repo_cache, old_files, old_chunks);
+    }
+  if (!repo_cache->error)
+    dnf_repo_check (repo_cache->repo, params->cache_age, check_state, &repo_cache->error);
+  repo_cache->fetch_usec += g_get_monotonic_time () - start;
+}
+
+/* Loads the current metadata of the repository into its own sack, which writes the solv/solvx
+ * cache. libsolv pools are independent, so the repositories are converted in parallel. The
+ * worker only uses its own sack and the HyRepo of its repository, no other thread touches
+ * either; the DnfRepo, the context and librepo are not used. */
+static void
+write_solv_cache_worker (gpointer data, gpointer user_data)
+{
+  RepoCache *repo_cache = data;
+  const MakecacheParams *params = user_data;
+  g_autoptr(DnfSack) sack = dnf_sack_new ();
+
+  dnf_sack_set_cachedir (sack, params->solv_dir);
+  dnf_sack_set_rootdir (sack, params->install_root);
+  if (!dnf_sack_setup (sack, DNF_SACK_SETUP_FLAG_MAKE_CACHE_DIR, &repo_cache->error))
+    return;
+
+  gint64 convert_start = g_get_monotonic_time ();
+  int flags = DNF_SACK_LOAD_FLAG_BUILD_CACHE | DNF_SACK_LOAD_FLAG_USE_FILELISTS | DNF_SACK_LOAD_FLAG_USE_UPDATEINFO;
+  if (!dnf_sack_load_repo (sack, repo_cache->hrepo, flags, &repo_cache->error))
+    return;
+  repo_cache->convert_usec = g_get_monotonic_time () - convert_start;
+
+  hy_autoquery HyQuery query = hy_query_create (sack);
+  DnfPackageSet *pset = hy_query_run_set (query);
+  repo_cache->packages = dnf_packageset_count (pset);
+  dnf_packageset_free (pset);
+  repo_cache->solv_size = get_solv_size (params->solv_dir, repo_cache->id);
+}
+
+static void
+append_json_string (GString *out, const gchar *str)
+{
+  g_string_append_c (out, '"');
+  for (const gchar *p = str; *p; ++p)
+    {
+      if (*p == '"' || *p == '\\')
+        g_string_append_printf (out, "\\%c", *p);
+      else if ((guchar) *p < 0x20)
+        g_string_append_printf (out, "\\u%04x", (guchar) *p);
+      else
+        g_string_append_c (out, *p);
+    }
+  g_string_append_c (out, '"');
+}
+
+static void
+print_stats_json (GArray *repo_caches)
+{
+  g_autoptr(GString) out = g_string_new ("{\n  \"repos\": [");
+  for (guint i = 0; i < repo_caches->len; ++i)
+    {
+      RepoCache *repo_cache = &g_array_index (repo_caches, RepoCache, i);
+      g_string_append (out, i > 0 ? ",\n    {" : "\n    {");
+      g_string_append (out, "\"id\": ");
+      append_json_string (out, dnf_repo_get_id (repo_cache->repo));
+      g_string_append_printf (out, ", \"ok\": %s", repo_cache->error ? "false" : "true");
+      g_string_append_printf (out, ", \"refreshed\": %s", repo_cache->refreshed ? "true" : "false");
+      g_string_append_printf (out, ", \"downloaded_bytes\": %" G_GUINT64_FORMAT, repo_cache->downloaded);
+      if (repo_cache->repomd_ttfb >= 0)
+        g_string_append_printf (out, ", \"repomd_ttfb_seconds\": %.3f", repo_cache->repomd_ttfb);
+      else
+        g_string_append (out, ", \"repomd_ttfb_seconds\": null");
+      g_string_append_printf (out, ", \"fetch_seconds\": %.3f", (gdouble) repo_cache->fetch_usec / G_USEC_PER_SEC);
+      g_string_append_printf (out, ", \"convert_seconds\": %.3f", (gdouble) repo_cache->convert_usec / G_USEC_PER_SEC);
+      g_string_append_printf (out, ", \"packages\": %u", repo_cache->packages);
+      g_string_append_printf (out, ", \"solv_bytes\": %" G_GUINT64_FORMAT, repo_cache->solv_size);
+      g_string_append_printf (out, ", \"zchunk_reused_bytes\": %" G_GUINT64_FORMAT "}", repo_cache->zck_reused);
+    }
+  g_string_append (out, repo_caches->len > 0 ? "\n  ]\n}\n" : "]\n}\n");
+  fputs (out->str, stdout);
+}
+
+static void
+print_stats (GArray *repo_caches)
+{
+  gint id_width = strlen ("Repository");
+  for (guint i = 0; i < repo_caches->len; ++i)
+    id_width = MAX (id_width, (gint) strlen (dnf_repo_get_id (g_array_index (repo_caches, RepoCache, i).repo)));
+
+  g_print ("%-*s %12s %11s %9s %9s %9s %12s\n", id_width,
+           "Repository", "Downloaded", "Repomd TTFB", "Fetch", "Convert", "Packages", "Solv size");
+  for (guint i = 0; i < repo_caches->len; ++i)
+    {
+      RepoCache *repo_cache = &g_array_index (repo_caches, RepoCache, i);
+      const gchar *id = dnf_repo_get_id (repo_cache->repo);
+      if (repo_cache->error)
+        {
+          g_print ("%-*s %12s\n", id_width, id, "failed");
+          continue;
+        }
+      g_autofree gchar *downloaded = g_format_size (repo_cache->downloaded);
+      g_autofree gchar *ttfb = repo_cache->repomd_ttfb >= 0 ? g_strdup_printf ("%.3fs", repo_cache->repomd_ttfb)
+                                                            : g_strdup ("-");
+      g_autofree gchar *solv_size = g_format_size (repo_cache->solv_size);
+      g_print ("%-*s %12s %11s %8.3fs %8.3fs %9u %12s\n", id_width, id, downloaded, ttfb,
+               (gdouble) repo_cache->fetch_usec / G_USEC_PER_SEC,
+               (gdouble) repo_cache->convert_usec / G_USEC_PER_SEC,
+               repo_cache->packages, solv_size);
+    }
+}
+
 static gboolean
 dnf_command_makecache_run (DnfCommand      *cmd,
                            int              argc,
@@ -45,7 +672,16 @@ dnf_command_makecache_run (DnfCommand      *cmd,
                            DnfContext      *ctx,
                            GError         **error)
 {
+  gboolean opt_stats = FALSE;
+  gboolean opt_json = FALSE;
+  gboolean opt_revalidate = FALSE;
   const GOptionEntry opts[] = {
+    { "revalidate", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_revalidate,
+      "check whether an expired repomd.xml changed with a conditional request before downloading the metadata", NULL },
+    { "stats", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_stats,
+      "print download, timing and size statistics of each repository", NULL },
+    { "json", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_json,
+      "print the statistics as JSON (implies --stats)", NULL },
     { NULL }
   };
   g_option_context_add_main_entries (opt_ctx, opts, NULL);
@@ -59,11 +695,122 @@ dnf_command_makecache_run (DnfCommand      *cmd,
       return FALSE;
     }
 
-  DnfState * state = dnf_context_get_state (ctx);
-  DnfContextSetupSackFlags sack_flags = DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_RPMDB;
-  if (!dnf_context_setup_sack_with_flags (ctx, state, sack_flags, error)) {
-      return FALSE;
-  }
+  // use zchunk metadata where repositories publish it, unless disabled in the configuration
+  enum DnfConfPriority priority;
+  dnf_context_set_zchunk (ctx, dnf_utils_conf_main_get_bool_opt ("zchunk", &priority));
+
+  GPtrArray *repos = dnf_context_get_repos (ctx);
+  g_autoptr(GArray) repo_caches = g_array_new (FALSE, TRUE, sizeof (RepoCache));
+  g_array_set_clear_func (repo_caches, repo_cache_clear);
+  for (guint i = 0; i < repos->len; ++i)
+    {
+      DnfRepo *repo = g_ptr_array_index (repos, i);
+      if ((dnf_repo_get_enabled (repo) & DNF_REPO_ENABLED_METADATA) == 0)
+        continue;
+      RepoCache repo_cache = { .repo = repo };
+      g_array_append_val (repo_caches, repo_cache);
+    }
+
+  // the sack is not needed, the repositories are revalidated and converted in parallel
+  MakecacheParams params = {
+    .solv_dir = dnf_context_get_solv_dir (ctx),
+    .cache_dir = dnf_context_get_cache_dir (ctx),
+    .install_root = dnf_context_get_install_root (ctx),
+    .cache_age = dnf_context_get_cache_age (ctx),
+    .revalidate = opt_revalidate
+  };
+  dnf_utils_timings_phase ("metadata refresh");
+  guint nrequests = 0;
+  for (guint i = 0; i < repo_caches->len; ++i)
+    {
+      RepoCache *repo_cache = &g_array_index (repo_caches, RepoCache, i);
+      check_repo_cache (repo_cache, &params);
+      if (repo_cache->request)
+        nrequests++;
+    }
+  if (nrequests > 0)
+    {
+      // the requests wait on the network, not on the CPU
+      curl_global_init (CURL_GLOBAL_DEFAULT);
+      GThreadPool *pool = g_thread_pool_new (revalidate_repo_cache_worker, &params,
+                                             MIN (MAX (g_get_num_processors (), 8), nrequests),
+                                             FALSE, NULL);
+      for (guint i = 0; i < repo_caches->len; ++i)
+        {
+          RepoCache *repo_cache = &g_array_index (repo_caches, RepoCache, i);
+          if (repo_cache->request)
+            g_thread_pool_push (pool, repo_cache, NULL);
+        }
+      g_thread_pool_free (pool, FALSE, TRUE);
+      curl_global_cleanup ();
+    }
+  guint nconvert = 0;
+  for (guint i = 0; i < repo_caches->len; ++i)
+    {
+      RepoCache *repo_cache = &g_array_index (repo_caches, RepoCache, i);
+      if (repo_cache->expired)
+        update_repo_cache (repo_cache, &params);
+      if (repo_cache->error)
+        continue;
+      repo_cache->hrepo = dnf_repo_get_repo (repo_cache->repo);
+      nconvert++;
+    }
+
+  dnf_utils_timings_phase ("solv cache");
+  if (nconvert > 0)
+    {
+      GThreadPool *pool = g_thread_pool_new (write_solv_cache_worker, &params,
+                                             MIN (g_get_num_processors (), nconvert),
+                                             FALSE, NULL);
+      for (guint i = 0; i < repo_caches->len; ++i)
+        {
+          RepoCache *repo_cache = &g_array_index (repo_caches, RepoCache, i);
+          if (!repo_cache->error)
+            g_thread_pool_push (pool, repo_cache, NULL);
+        }
+      g_thread_pool_free (pool, FALSE, TRUE);
+    }
+
+  for (guint i = 0; i < repo_caches->len; ++i)
+    {
+      RepoCache *repo_cache = &g_array_index (repo_caches, RepoCache, i);
+      if (!repo_cache->error)
+        continue;
+      if (dnf_repo_get_required (repo_cache->repo))
+        {
+          g_propagate_prefixed_error (error, g_steal_pointer (&repo_cache->error),
+                                      "Failed to refresh repo '%s': ", dnf_repo_get_id (repo_cache->repo));
+          return FALSE;
+        }
+      g_printerr ("Skipping unavailable repo '%s': %s\n",
+                  dnf_repo_get_id (repo_cache->repo), repo_cache->error->message);
+    }
+
+  if (opt_json)
+    {
+      print_stats_json (repo_caches);
+      return TRUE;
+    }
+
+  guint64 zck_total = 0;
+  guint64 zck_reused = 0;
+  for (guint i = 0; i < repo_caches->len; ++i)
+    {
+      RepoCache *repo_cache = &g_array_index (repo_caches, RepoCache, i);
+      zck_total += repo_cache->zck_total;
+      zck_reused += repo_cache->zck_reused;
+    }
+  if (zck_total > 0)
+    {
+      g_autofree gchar *downloaded = g_format_size (zck_total - zck_reused);
+      g_autofree gchar *total = g_format_size (zck_total);
+      g_autofree gchar *saved = g_format_size (zck_reused);
+      g_print ("zchunk metadata: downloaded %s of %s, %s saved by reusing cached chunks.\n",
+               downloaded, total, saved);
+    }
+
+  if (opt_stats)
+    print_stats (repo_caches);
 
   g_print ("Metadata cache created.\n");
 
@@ -72,6 +72,7 @@ dnf_command_module_disable_run (DnfCommand      *cmd,
       return FALSE;
     }
 
+  dnf_utils_timings_phase ("depsolve");
   if (!dnf_goal_depsolve (dnf_context_get_goal (ctx), DNF_NONE, error))
     {
       if (g_error_matches (*error, DNF_ERROR, DNF_ERROR_NO_PACKAGES_TO_UPDATE))
@@ -81,6 +82,7 @@ dnf_command_module_disable_run (DnfCommand      *cmd,
           return FALSE;
         }
     }
+  dnf_utils_timings_phase ("confirmation");
   if (!dnf_utils_print_transaction (ctx))
     {
       return TRUE;
@@ -89,6 +91,7 @@ dnf_command_module_disable_run (DnfCommand      *cmd,
     {
       return FALSE;
     }
+  dnf_utils_timings_phase ("transaction");
   if (!dnf_context_run (ctx, NULL, error))
     {
       return FALSE;
@@ -76,6 +76,7 @@ dnf_command_module_enable_run (DnfCommand      *cmd,
       return FALSE;
     }
 
+  dnf_utils_timings_phase ("depsolve");
   if (!dnf_goal_depsolve (dnf_context_get_goal (ctx), DNF_NONE, error))
     {
       if (g_error_matches (*error, DNF_ERROR, DNF_ERROR_NO_PACKAGES_TO_UPDATE))
@@ -85,6 +86,7 @@ dnf_command_module_enable_run (DnfCommand      *cmd,
           return FALSE;
         }
     }
+  dnf_utils_timings_phase ("confirmation");
   if (!dnf_utils_print_transaction (ctx))
     {
       return TRUE;
@@ -93,6 +95,7 @@ dnf_command_module_enable_run (DnfCommand      *cmd,
     {
       return FALSE;
     }
+  dnf_utils_timings_phase ("transaction");
   if (!dnf_context_run (ctx, NULL, error))
     {
       return FALSE;
@@ -147,10 +147,12 @@ dnf_command_reinstall_run (DnfCommand      *cmd,
     }
 
   DnfState * state = dnf_context_get_state (ctx);
+  dnf_utils_timings_phase ("sack setup");
   if (!dnf_context_setup_sack_with_flags (ctx, state, DNF_CONTEXT_SETUP_SACK_FLAG_NONE, error)) {
       return FALSE;
   }
 
+  dnf_utils_timings_phase ("subject resolution");
   for (GStrv pkg = pkgs; *pkg != NULL; pkg++)
     {
       if (!dnf_command_reinstall_arg (ctx, *pkg, error))
@@ -160,6 +162,7 @@ dnf_command_reinstall_run (DnfCommand      *cmd,
   DnfGoalActions flags = DNF_INSTALL;
   if (!dnf_context_get_install_weak_deps ())
     flags |= DNF_IGNORE_WEAK_DEPS;  
+  dnf_utils_timings_phase ("depsolve");
   if (!dnf_goal_depsolve (dnf_context_get_goal (ctx), flags, error))
     return FALSE;
   
@@ -167,10 +170,12 @@ dnf_command_reinstall_run (DnfCommand      *cmd,
   int tsflags = dnf_transaction_get_flags (transaction);
   dnf_transaction_set_flags(transaction, tsflags | DNF_TRANSACTION_FLAG_ALLOW_REINSTALL);
 
+  dnf_utils_timings_phase ("confirmation");
   if (!dnf_utils_print_transaction (ctx))
     return TRUE;
   if (!dnf_utils_userconfirm ())
     return FALSE;
+  dnf_utils_timings_phase ("transaction");
   if (!dnf_context_run (ctx, NULL, error))
     return FALSE;
 
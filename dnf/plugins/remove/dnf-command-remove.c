@@ -78,17 +78,25 @@ dnf_command_remove_run (DnfCommand      *cmd,
 
   disable_available_repos (ctx);
 
+  dnf_utils_timings_phase ("sack setup");
+  if (!dnf_utils_context_setup_sack (ctx, DNF_CONTEXT_SETUP_SACK_FLAG_NONE, error))
+    return FALSE;
+
   /* Remove each package */
+  dnf_utils_timings_phase ("subject resolution");
   for (GStrv pkg = pkgs; *pkg != NULL; pkg++)
     {
       if (!dnf_context_remove (ctx, *pkg, error))
         return FALSE;
     }
+  dnf_utils_timings_phase ("depsolve");
   if (!dnf_goal_depsolve (dnf_context_get_goal (ctx), DNF_ERASE, error))
     return FALSE;
+  dnf_utils_timings_phase ("confirmation");
   dnf_utils_print_transaction (ctx);
   if (!dnf_utils_userconfirm ())
     return FALSE;
+  dnf_utils_timings_phase ("transaction");
   if (!dnf_context_run (ctx, NULL, error))
     return FALSE;
   g_print ("Complete.\n");
@@ -19,8 +19,22 @@
  */
 
 #include "dnf-command-repoquery.h"
+#include "dnf-utils.h"
 
+#include <ctype.h>
 #include <libsmartcols.h>
+#include <solv/evr.h>
+#include <solv/pool.h>
+#include <solv/queue.h>
+#include <solv/repo.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <wctype.h>
+
+// output is collected and written to stdout in chunks of about this size
+#define OUTPUT_FLUSH_SIZE (256 * 1024)
 
 struct _DnfCommandRepoquery
 {
@@ -59,16 +73,169 @@ gptrarr_dnf_package_cmp (gconstpointer a, gconstpointer b)
 }
 
 static void
-package_info_add_line (struct libscols_table *table, const char *key, const char *value)
+output_flush (GString *out)
+{
+  if (out->len > 0)
+    {
+      fwrite (out->str, 1, out->len, stdout);
+      g_string_truncate (out, 0);
+    }
+}
+
+static void
+output_maybe_flush (GString *out)
+{
+  if (out->len >= OUTPUT_FLUSH_SIZE)
+    output_flush (out);
+}
+
+static void
+output_append_hex (GString *out, const char *str, size_t len)
+{
+  for (size_t i = 0; i < len; ++i)
+    g_string_append_printf (out, "\\x%02x", (unsigned char) str[i]);
+}
+
+/* Appends `str` encoded the way libsmartcols encodes cell data (mbs_safe_encode):
+ * control characters, "\x" sequences and non-printable multibyte characters are
+ * written as "\xHH" escapes. Depends on the current locale, just like libsmartcols. */
+static void
+output_append_safe (GString *out, const char *str, size_t len)
+{
+  const char *p = str;
+  const char *end = str + len;
+  mbstate_t state;
+
+  memset (&state, 0, sizeof (state));
+  while (p < end)
+    {
+      if ((*p == '\\' && p + 1 < end && p[1] == 'x') || iscntrl ((unsigned char) *p))
+        {
+          output_append_hex (out, p++, 1);
+          continue;
+        }
+
+      wchar_t wc;
+      size_t clen = mbrtowc (&wc, p, end - p, &state);
+      if (clen == (size_t) -1 || clen == (size_t) -2)
+        {
+          // not a valid multibyte sequence
+          if (isprint ((unsigned char) *p))
+            g_string_append_c (out, *p);
+          else
+            output_append_hex (out, p, 1);
+          memset (&state, 0, sizeof (state));
+          clen = 1;
+        }
+      else if (!iswprint (wc))
+        output_append_hex (out, p, clen);
+      else
+        g_string_append_len (out, p, clen);
+      p += clen;
+    }
+}
+
+typedef struct
+{
+  const char *key;
+  const char *value;
+} InfoLine;
+
+static const char * const info_keys[] = {
+  "Name", "Epoch", "Version", "Release", "Architecture", "Size", "Source",
+  "Repository", "Summary", "URL", "License", "Description"
+};
+
+/* Width of the key column as libsmartcols computes it: the widest key printed.
+ * "Architecture" is printed for every package, so this is constant. */
+static gsize
+info_key_width (void)
+{
+  gsize width = 0;
+  for (guint i = 0; i < G_N_ELEMENTS (info_keys); ++i)
+    width = MAX (width, strlen (info_keys[i]));
+  return width;
+}
+
+/* Mirrors a noheadings scols table with a " : " separator and a value column
+ * wrapped on new lines: continuation lines get an empty key cell and the last
+ * column is never padded. */
+static void
+output_info_line (GString *out, gsize key_width, const char *key, const char *value)
+{
+  gsize key_len = strlen (key);
+
+  g_string_append_len (out, key, key_len);
+  for (gsize i = key_len; i < key_width; ++i)
+    g_string_append_c (out, ' ');
+  g_string_append (out, " : ");
+
+  if (value)
+    {
+      const char *chunk = value;
+      const char *nl;
+      while ((nl = strchr (chunk, '\n')) != NULL)
+        {
+          output_append_safe (out, chunk, nl - chunk);
+          g_string_append_c (out, '\n');
+          for (gsize i = 0; i < key_width; ++i)
+            g_string_append_c (out, ' ');
+          g_string_append (out, " : ");
+          chunk = nl + 1;
+        }
+      output_append_safe (out, chunk, strlen (chunk));
+    }
+  g_string_append_c (out, '\n');
+}
+
+static guint
+get_package_info (DnfPackage *package, InfoLine *lines, gchar **epoch, gchar **size)
+{
+  guint n = 0;
+
+  lines[n++] = (InfoLine) { "Name", dnf_package_get_name (package) };
+  guint64 epoch_num = dnf_package_get_epoch (package);
+  if (epoch_num != 0)
+    {
+      *epoch = g_strdup_printf ("%ld", epoch_num);
+      lines[n++] = (InfoLine) { "Epoch", *epoch };
+    }
+  lines[n++] = (InfoLine) { "Version", dnf_package_get_version (package) };
+  lines[n++] = (InfoLine) { "Release", dnf_package_get_release (package) };
+  lines[n++] = (InfoLine) { "Architecture", dnf_package_get_arch (package) };
+  *size = g_format_size_full (dnf_package_get_size (package),
+                              G_FORMAT_SIZE_LONG_FORMAT | G_FORMAT_SIZE_IEC_UNITS);
+  lines[n++] = (InfoLine) { "Size", *size };
+  lines[n++] = (InfoLine) { "Source", dnf_package_get_sourcerpm (package) };
+  lines[n++] = (InfoLine) { "Repository", dnf_package_get_reponame (package) };
+  lines[n++] = (InfoLine) { "Summary", dnf_package_get_summary (package) };
+  lines[n++] = (InfoLine) { "URL", dnf_package_get_url (package) };
+  lines[n++] = (InfoLine) { "License", dnf_package_get_license (package) };
+  lines[n++] = (InfoLine) { "Description", dnf_package_get_description (package) };
+
+  return n;
+}
+
+static void
+output_package_info (GString *out, gsize key_width, DnfPackage *package)
 {
-  struct libscols_line *ln = scols_table_new_line (table, NULL);
-  scols_line_set_data (ln, 0, key);
-  scols_line_set_data (ln, 1, value);
+  InfoLine lines[G_N_ELEMENTS (info_keys)];
+  g_autofree gchar *epoch = NULL;
+  g_autofree gchar *size = NULL;
+
+  guint n = get_package_info (package, lines, &epoch, &size);
+  for (guint i = 0; i < n; ++i)
+    output_info_line (out, key_width, lines[i].key, lines[i].value);
 }
 
+/* On a terminal libsmartcols fits the table to the terminal width, keep using it there */
 static void
-print_package_info (DnfPackage *package)
+print_package_info_table (DnfPackage *package)
 {
+  InfoLine lines[G_N_ELEMENTS (info_keys)];
+  g_autofree gchar *epoch = NULL;
+  g_autofree gchar *size = NULL;
+
   struct libscols_table *table = scols_new_table ();
   scols_table_enable_noheadings (table, 1);
   scols_table_set_column_separator (table, " : ");
@@ -77,30 +244,468 @@ print_package_info (DnfPackage *package)
   scols_column_set_safechars (cl, "\n");
   scols_column_set_wrapfunc (cl, scols_wrapnl_chunksize, scols_wrapnl_nextchunk, NULL);
 
-  package_info_add_line (table, "Name", dnf_package_get_name (package));
-  guint64 epoch = dnf_package_get_epoch (package);
-  if (epoch != 0)
-    {
-      g_autofree gchar *str_epoch = g_strdup_printf ("%ld", epoch);
-      package_info_add_line (table, "Epoch", str_epoch);
-    }
-  package_info_add_line (table, "Version", dnf_package_get_version (package));
-  package_info_add_line (table, "Release", dnf_package_get_release (package));
-  package_info_add_line (table, "Architecture", dnf_package_get_arch (package));
-  g_autofree gchar *size = g_format_size_full (dnf_package_get_size (package),
-                                               G_FORMAT_SIZE_LONG_FORMAT | G_FORMAT_SIZE_IEC_UNITS);
-  package_info_add_line (table, "Size", size);
-  package_info_add_line (table, "Source", dnf_package_get_sourcerpm (package));
-  package_info_add_line (table, "Repository", dnf_package_get_reponame (package));
-  package_info_add_line (table, "Summary", dnf_package_get_summary (package));
-  package_info_add_line (table, "URL", dnf_package_get_url (package));
-  package_info_add_line (table, "License", dnf_package_get_license (package));
-  package_info_add_line (table, "Description", dnf_package_get_description (package));
+  guint n = get_package_info (package, lines, &epoch, &size);
+  for (guint i = 0; i < n; ++i)
+    {
+      struct libscols_line *ln = scols_table_new_line (table, NULL);
+      scols_line_set_data (ln, 0, lines[i].key);
+      scols_line_set_data (ln, 1, lines[i].value);
+    }
 
   scols_print_table (table);
   scols_unref_table (table);
 }
 
+typedef enum
+{
+  QF_LITERAL,
+  QF_NAME,
+  QF_EPOCH,
+  QF_VERSION,
+  QF_RELEASE,
+  QF_ARCH,
+  QF_EVR,
+  QF_NEVRA,
+  QF_REPONAME,
+  QF_SIZE,
+  QF_DOWNLOADSIZE,
+  QF_INSTALLSIZE,
+  QF_SOURCERPM,
+  QF_SUMMARY,
+  QF_DESCRIPTION,
+  QF_LICENSE,
+  QF_URL,
+  QF_LOCATION,
+  QF_BUILDTIME,
+  QF_INSTALLTIME
+} QueryFormatTag;
+
+static const struct
+{
+  const char *name;
+  QueryFormatTag tag;
+} query_format_tags[] = {
+  { "name", QF_NAME },
+  { "epoch", QF_EPOCH },
+  { "version", QF_VERSION },
+  { "release", QF_RELEASE },
+  { "arch", QF_ARCH },
+  { "evr", QF_EVR },
+  { "nevra", QF_NEVRA },
+  { "reponame", QF_REPONAME },
+  { "repoid", QF_REPONAME },
+  { "size", QF_SIZE },
+  { "downloadsize", QF_DOWNLOADSIZE },
+  { "installsize", QF_INSTALLSIZE },
+  { "sourcerpm", QF_SOURCERPM },
+  { "summary", QF_SUMMARY },
+  { "description", QF_DESCRIPTION },
+  { "license", QF_LICENSE },
+  { "url", QF_URL },
+  { "location", QF_LOCATION },
+  { "buildtime", QF_BUILDTIME },
+  { "installtime", QF_INSTALLTIME },
+};
+
+// solvable ids that determine the content of a printed row
+enum
+{
+  ROW_NAME = 1 << 0,
+  ROW_EVR = 1 << 1,
+  ROW_ARCH = 1 << 2,
+  ROW_REPO = 1 << 3
+};
+
+typedef struct
+{
+  QueryFormatTag tag;
+  gint width;     // field width, negative value aligns to the left, 0 means no padding
+  gsize offset;   // QF_LITERAL: text in QueryFormat.literals
+  gsize len;
+} QueryFormatOp;
+
+typedef struct
+{
+  GArray *ops;
+  GString *literals;
+  gboolean by_ids;    // all tags are derived from the row fields below
+  guint row_fields;   // ROW_* flags of the solvable ids the tags are derived from
+} QueryFormat;
+
+static void
+query_format_free (QueryFormat *qf)
+{
+  g_array_unref (qf->ops);
+  g_string_free (qf->literals, TRUE);
+  g_free (qf);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (QueryFormat, query_format_free)
+
+static void
+query_format_add_literal (QueryFormat *qf, const char *text, gsize len)
+{
+  QueryFormatOp *last = qf->ops->len > 0 ? &g_array_index (qf->ops, QueryFormatOp, qf->ops->len - 1) : NULL;
+
+  // merge adjacent literals, their text is contiguous in qf->literals
+  if (last && last->tag == QF_LITERAL && last->offset + last->len == qf->literals->len)
+    last->len += len;
+  else
+    {
+      QueryFormatOp op = { QF_LITERAL, 0, qf->literals->len, len };
+      g_array_append_val (qf->ops, op);
+    }
+  g_string_append_len (qf->literals, text, len);
+}
+
+/* Compiles a format like "%{name}-%-10{arch}\t%{size}" into a list of operations.
+ * Supports "\n", "\t" and "\\" escapes and "%%" for a literal percent sign,
+ * "%" not followed by a tag is taken literally. */
+static QueryFormat *
+query_format_compile (const char *format, GError **error)
+{
+  g_autoptr(QueryFormat) qf = g_new0 (QueryFormat, 1);
+  qf->ops = g_array_new (FALSE, FALSE, sizeof (QueryFormatOp));
+  qf->literals = g_string_new (NULL);
+
+  const char *p = format;
+  while (*p)
+    {
+      if (p[0] == '\\' && (p[1] == 'n' || p[1] == 't' || p[1] == '\\'))
+        {
+          query_format_add_literal (qf, p[1] == 'n' ? "\n" : p[1] == 't' ? "\t" : "\\", 1);
+          p += 2;
+          continue;
+        }
+      if (p[0] == '%' && p[1] == '%')
+        {
+          query_format_add_literal (qf, "%", 1);
+          p += 2;
+          continue;
+        }
+      if (p[0] == '%')
+        {
+          const char *q = p + 1;
+          gboolean left = FALSE;
+          gint width = 0;
+          if (*q == '-')
+            {
+              left = TRUE;
+              ++q;
+            }
+          while (g_ascii_isdigit (*q) && width < 10000)
+            width = width * 10 + (*q++ - '0');
+          const char *end = *q == '{' ? strchr (q, '}') : NULL;
+          if (end)
+            {
+              g_autofree gchar *name = g_strndup (q + 1, end - q - 1);
+              guint i;
+              for (i = 0; i < G_N_ELEMENTS (query_format_tags); ++i)
+                if (strcmp (query_format_tags[i].name, name) == 0)
+                  break;
+              if (i == G_N_ELEMENTS (query_format_tags))
+                {
+                  g_set_error (error,
+                               G_OPTION_ERROR,
+                               G_OPTION_ERROR_BAD_VALUE,
+                               "Unknown tag in --queryformat: %s", name);
+                  return NULL;
+                }
+              QueryFormatOp op = { query_format_tags[i].tag, left ? -width : width, 0, 0 };
+              g_array_append_val (qf->ops, op);
+              p = end + 1;
+              continue;
+            }
+        }
+      query_format_add_literal (qf, p, 1);
+      ++p;
+    }
+
+  qf->by_ids = TRUE;
+  for (guint i = 0; i < qf->ops->len; ++i)
+    {
+      switch (g_array_index (qf->ops, QueryFormatOp, i).tag)
+        {
+        case QF_LITERAL:
+          break;
+        case QF_NAME:
+          qf->row_fields |= ROW_NAME;
+          break;
+        case QF_EPOCH:
+        case QF_VERSION:
+        case QF_RELEASE:
+        case QF_EVR:
+          qf->row_fields |= ROW_EVR;
+          break;
+        case QF_ARCH:
+          qf->row_fields |= ROW_ARCH;
+          break;
+        case QF_NEVRA:
+          qf->row_fields |= ROW_NAME | ROW_EVR | ROW_ARCH;
+          break;
+        case QF_REPONAME:
+          qf->row_fields |= ROW_REPO;
+          break;
+        default:
+          qf->by_ids = FALSE;
+          break;
+        }
+    }
+
+  return g_steal_pointer (&qf);
+}
+
+static void
+output_append_field (GString *out, const char *value, gint width)
+{
+  if (!value)
+    value = "";
+  if (width == 0)
+    {
+      g_string_append (out, value);
+      return;
+    }
+
+  glong pad = ABS (width) - g_utf8_strlen (value, -1);
+  if (width < 0)
+    g_string_append (out, value);
+  for (glong i = 0; i < pad; ++i)
+    g_string_append_c (out, ' ');
+  if (width > 0)
+    g_string_append (out, value);
+}
+
+static void
+output_append_number (GString *out, guint64 value, gint width)
+{
+  gchar buf[24];
+  g_snprintf (buf, sizeof (buf), "%" G_GUINT64_FORMAT, value);
+  output_append_field (out, buf, width);
+}
+
+static void
+query_format_run (const QueryFormat *qf, DnfPackage *package, GString *out)
+{
+  for (guint i = 0; i < qf->ops->len; ++i)
+    {
+      const QueryFormatOp *op = &g_array_index (qf->ops, QueryFormatOp, i);
+      switch (op->tag)
+        {
+        case QF_LITERAL:
+          g_string_append_len (out, qf->literals->str + op->offset, op->len);
+          break;
+        case QF_NAME:
+          output_append_field (out, dnf_package_get_name (package), op->width);
+          break;
+        case QF_EPOCH:
+          output_append_number (out, dnf_package_get_epoch (package), op->width);
+          break;
+        case QF_VERSION:
+          output_append_field (out, dnf_package_get_version (package), op->width);
+          break;
+        case QF_RELEASE:
+          output_append_field (out, dnf_package_get_release (package), op->width);
+          break;
+        case QF_ARCH:
+          output_append_field (out, dnf_package_get_arch (package), op->width);
+          break;
+        case QF_EVR:
+          output_append_field (out, dnf_package_get_evr (package), op->width);
+          break;
+        case QF_NEVRA:
+          output_append_field (out, dnf_package_get_nevra (package), op->width);
+          break;
+        case QF_REPONAME:
+          output_append_field (out, dnf_package_get_reponame (package), op->width);
+          break;
+        case QF_SIZE:
+          output_append_number (out, dnf_package_get_size (package), op->width);
+          break;
+        case QF_DOWNLOADSIZE:
+          output_append_number (out, dnf_package_get_downloadsize (package), op->width);
+          break;
+        case QF_INSTALLSIZE:
+          output_append_number (out, dnf_package_get_installsize (package), op->width);
+          break;
+        case QF_SOURCERPM:
+          output_append_field (out, dnf_package_get_sourcerpm (package), op->width);
+          break;
+        case QF_SUMMARY:
+          output_append_field (out, dnf_package_get_summary (package), op->width);
+          break;
+        case QF_DESCRIPTION:
+          output_append_field (out, dnf_package_get_description (package), op->width);
+          break;
+        case QF_LICENSE:
+          output_append_field (out, dnf_package_get_license (package), op->width);
+          break;
+        case QF_URL:
+          output_append_field (out, dnf_package_get_url (package), op->width);
+          break;
+        case QF_LOCATION:
+          output_append_field (out, dnf_package_get_location (package), op->width);
+          break;
+        case QF_BUILDTIME:
+          output_append_number (out, dnf_package_get_buildtime (package), op->width);
+          break;
+        case QF_INSTALLTIME:
+          output_append_number (out, dnf_package_get_installtime (package), op->width);
+          break;
+        }
+    }
+}
+
+static gint
+strptr_cmp (gconstpointer a, gconstpointer b)
+{
+  return strcmp (*(const char **)a, *(const char **)b);
+}
+
+/* Prints the sorted union of the `keyname` dependencies (SOLVABLE_REQUIRES,
+ * SOLVABLE_PROVIDES) of all packages in the query, straight from the pool.
+ * Returns the number of lines. */
+static guint
+output_query_deps (GString *out, DnfSack *sack, HyQuery query, Id keyname, gboolean count_only)
+{
+  Pool *pool = dnf_sack_get_pool (sack);
+  DnfPackageSet *pset = hy_query_run_set (query);
+  Map *map = dnf_packageset_get_map (pset);
+  g_autoptr(GHashTable) seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+  g_autoptr(GPtrArray) deps = g_ptr_array_new_with_free_func (g_free);
+  Queue q;
+
+  queue_init (&q);
+  for (Id p = 2; p < pool->nsolvables; ++p)
+    {
+      if (!MAPTST (map, p))
+        continue;
+      solvable_lookup_deparray (pool_id2solvable (pool, p), keyname, &q, 0);
+      for (int i = 0; i < q.count; ++i)
+        {
+          Id dep = q.elements[i];
+          if (dep == SOLVABLE_PREREQMARKER || dep == SOLVABLE_FILEMARKER)
+            continue;
+          if (g_hash_table_add (seen, GINT_TO_POINTER (dep)))
+            g_ptr_array_add (deps, g_strdup (pool_dep2str (pool, dep)));
+        }
+    }
+  queue_free (&q);
+  dnf_packageset_free (pset);
+
+  g_ptr_array_sort (deps, strptr_cmp);
+  const char *prev_line = "";
+  guint lines = 0;
+  for (guint i = 0; i < deps->len; ++i)
+    {
+      const char *line = g_ptr_array_index (deps, i);
+      // distinct ids can still render to the same string
+      if (strcmp (line, prev_line) != 0)
+        {
+          if (!count_only)
+            {
+              g_string_append (out, line);
+              g_string_append_c (out, '\n');
+            }
+          prev_line = line;
+          ++lines;
+        }
+      output_maybe_flush (out);
+    }
+
+  return lines;
+}
+
+typedef struct
+{
+  Id name;
+  Id evr;
+  Id arch;
+  Id repo;
+} RowKey;
+
+static guint
+row_key_hash (gconstpointer key)
+{
+  const RowKey *k = key;
+  return ((k->name * 31u + k->evr) * 31u + k->arch) * 31u + k->repo;
+}
+
+static gboolean
+row_key_equal (gconstpointer a, gconstpointer b)
+{
+  return memcmp (a, b, sizeof (RowKey)) == 0;
+}
+
+// orders solvables like dnf_package_cmp: by name, evr, arch and repository name
+static gint
+solvable_id_cmp (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  Pool *pool = user_data;
+  Solvable *s1 = pool_id2solvable (pool, *(const Id *)a);
+  Solvable *s2 = pool_id2solvable (pool, *(const Id *)b);
+
+  gint ret = s1->name == s2->name ? 0 : strcmp (pool_id2str (pool, s1->name), pool_id2str (pool, s2->name));
+  if (ret == 0 && s1->evr != s2->evr)
+    ret = pool_evrcmp (pool, s1->evr, s2->evr, EVRCMP_COMPARE);
+  if (ret == 0 && s1->arch != s2->arch)
+    ret = strcmp (pool_id2str (pool, s1->arch), pool_id2str (pool, s2->arch));
+  if (ret == 0 && s1->repo != s2->repo)
+    ret = strcmp (s1->repo->name, s2->repo->name);
+  return ret;
+}
+
+/* Prints rows that depend only on the name, evr, arch and repository of the packages:
+ * NEVRAs, or a --queryformat using only such tags. Works on the solvable ids of the
+ * result, duplicate rows are dropped by comparing ids and a package object is created
+ * only for each printed row, none when just counting. Returns the number of rows. */
+static guint
+output_query_rows (GString *out, DnfSack *sack, HyQuery query, const QueryFormat *qf, gboolean count_only)
+{
+  Pool *pool = dnf_sack_get_pool (sack);
+  guint fields = qf ? qf->row_fields : ROW_NAME | ROW_EVR | ROW_ARCH;
+  DnfPackageSet *pset = hy_query_run_set (query);
+  Map *map = dnf_packageset_get_map (pset);
+  g_autoptr(GArray) ids = g_array_new (FALSE, FALSE, sizeof (Id));
+
+  for (Id p = 2; p < pool->nsolvables; ++p)
+    if (MAPTST (map, p))
+      g_array_append_val (ids, p);
+  dnf_packageset_free (pset);
+
+  if (!count_only)
+    g_array_sort_with_data (ids, solvable_id_cmp, pool);
+
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (row_key_hash, row_key_equal, g_free, NULL);
+  for (guint i = 0; i < ids->len; ++i)
+    {
+      Id p = g_array_index (ids, Id, i);
+      Solvable *s = pool_id2solvable (pool, p);
+      RowKey key = {
+        fields & ROW_NAME ? s->name : 0,
+        fields & ROW_EVR ? s->evr : 0,
+        fields & ROW_ARCH ? s->arch : 0,
+        fields & ROW_REPO ? s->repo->repoid : 0
+      };
+      if (g_hash_table_contains (seen, &key))
+        continue;
+      RowKey *stored = g_new (RowKey, 1);
+      *stored = key;
+      g_hash_table_add (seen, stored);
+      if (count_only)
+        continue;
+
+      g_autoptr(DnfPackage) package = dnf_package_new (sack, p);
+      if (qf)
+        query_format_run (qf, package, out);
+      else
+        g_string_append (out, dnf_package_get_nevra (package));
+      g_string_append_c (out, '\n');
+      output_maybe_flush (out);
+    }
+
+  return g_hash_table_size (seen);
+}
+
 static gboolean
 dnf_command_repoquery_run (DnfCommand     *cmd,
                           int              argc,
@@ -110,16 +715,38 @@ dnf_command_repoquery_run (DnfCommand     *cmd,
                           GError         **error)
 {
   gboolean opt_available = FALSE;
+  gboolean opt_count = FALSE;
   gboolean opt_info = FALSE;
   gboolean opt_installed = FALSE;
   gboolean opt_nevra = FALSE;
+  gboolean opt_provides = FALSE;
+  gboolean opt_requires = FALSE;
+  g_autofree gchar *opt_queryformat = NULL;
+  g_auto(GStrv) opt_whatprovides = NULL;
+  g_auto(GStrv) opt_whatrequires = NULL;
+  g_auto(GStrv) opt_whatrecommends = NULL;
   g_auto(GStrv) opt_key = NULL;
   const GOptionEntry opts[] = {
     { "available", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_available, "display available packages (default)", NULL },
+    { "count", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_count,
+      "display only the number of lines (packages with --info) that would be printed", NULL },
     { "info", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_info, "show detailed information about the packages", NULL },
     { "installed", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_installed, "display installed packages", NULL },
     { "nevra", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_nevra,
       "use name-epoch:version-release.architecture format for displaying packages (default)", NULL },
+    { "queryformat", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING, &opt_queryformat,
+      "display packages using the given format, e.g. \"%{name}-%{evr}.%{arch}\"", "FORMAT" },
+    { "qf", '\0', G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_STRING, &opt_queryformat, NULL, "FORMAT" },
+    { "provides", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_provides,
+      "display capabilities provided by the packages", NULL },
+    { "requires", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_requires,
+      "display capabilities the packages depend on", NULL },
+    { "whatprovides", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING_ARRAY, &opt_whatprovides,
+      "show only packages that provide the capability or file (can be used multiple times)", "REQ" },
+    { "whatrequires", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING_ARRAY, &opt_whatrequires,
+      "show only packages that require the capability (can be used multiple times)", "REQ" },
+    { "whatrecommends", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING_ARRAY, &opt_whatrecommends,
+      "show only packages that recommend the capability (can be used multiple times)", "REQ" },
     { G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_STRING_ARRAY, &opt_key, NULL, NULL },
     { NULL }
   };
@@ -128,6 +755,31 @@ dnf_command_repoquery_run (DnfCommand     *cmd,
   if (!g_option_context_parse (opt_ctx, &argc, &argv, error))
     return FALSE;
 
+  if ((opt_provides || opt_requires) && (opt_provides + opt_requires + opt_info + opt_nevra > 1 || opt_queryformat))
+    {
+      g_set_error_literal (error,
+                           G_OPTION_ERROR,
+                           G_OPTION_ERROR_BAD_VALUE,
+                           "--provides and --requires cannot be combined with each other or with other output formats");
+      return FALSE;
+    }
+
+  g_autoptr(QueryFormat) queryformat = NULL;
+  if (opt_queryformat)
+    {
+      if (opt_info || opt_nevra)
+        {
+          g_set_error_literal (error,
+                               G_OPTION_ERROR,
+                               G_OPTION_ERROR_BAD_VALUE,
+                               "--queryformat cannot be combined with --info or --nevra");
+          return FALSE;
+        }
+      queryformat = query_format_compile (opt_queryformat, error);
+      if (!queryformat)
+        return FALSE;
+    }
+
   // --available is default (compatibility with YUM/DNF)
   if (!opt_available && !opt_installed)
     opt_available = TRUE;
@@ -138,22 +790,40 @@ dnf_command_repoquery_run (DnfCommand     *cmd,
   if (opt_installed)
     disable_available_repos (ctx);
 
-  DnfState * state = dnf_context_get_state (ctx);
   DnfContextSetupSackFlags sack_flags = opt_available ? DNF_CONTEXT_SETUP_SACK_FLAG_SKIP_RPMDB
                                                       : DNF_CONTEXT_SETUP_SACK_FLAG_NONE;
-  if (!dnf_context_setup_sack_with_flags (ctx, state, sack_flags, error)) {
+  dnf_utils_timings_phase ("sack setup");
+  if (!dnf_utils_context_setup_sack (ctx, sack_flags, error)) {
       return FALSE;
   }
   DnfSack *sack = dnf_context_get_sack (ctx);
 
+  dnf_utils_timings_phase ("subject resolution");
   hy_autoquery HyQuery query = hy_query_create (sack);
 
   if (opt_key)
     {
       hy_query_filter_empty (query);
-      for (char **pkey = opt_key; *pkey; ++pkey)
+
+      // names and exact NEVRAs are resolved together, the rest one by one
+      g_autoptr(GPtrArray) matches = dnf_utils_resolve_subjects (sack, opt_key, TRUE, TRUE);
+      DnfPackageSet *matched = dnf_packageset_new (sack);
+      for (guint i = 0; i < matches->len; ++i)
         {
-          g_auto(HySubject) subject = hy_subject_create (*pkey);
+          DnfPackageSet *pset = g_ptr_array_index (matches, i);
+          if (pset)
+            map_or (dnf_packageset_get_map (matched), dnf_packageset_get_map (pset));
+        }
+      hy_autoquery HyQuery matched_query = hy_query_create (sack);
+      hy_query_filter_package_in (matched_query, HY_PKG, HY_EQ, matched);
+      hy_query_union (query, matched_query);
+      dnf_packageset_free (matched);
+
+      for (guint i = 0; i < matches->len; ++i)
+        {
+          if (g_ptr_array_index (matches, i))
+            continue;
+          g_auto(HySubject) subject = hy_subject_create (opt_key[i]);
           HyNevra out_nevra;
           hy_autoquery HyQuery key_query = hy_subject_get_best_solution (subject, sack, NULL,
             &out_nevra, TRUE, TRUE, FALSE, TRUE, TRUE);
@@ -163,31 +833,98 @@ dnf_command_repoquery_run (DnfCommand     *cmd,
         }
     }
 
-  g_autoptr(GPtrArray) pkgs = hy_query_run (query);
+  // the sack can be preloaded with both installed and available packages (daemon mode);
+  // the argument matches above come from the whole sack, so they are filtered too
+  if (opt_available)
+    hy_query_filter (query, HY_PKG_REPONAME, HY_NEQ, HY_SYSTEM_REPO_NAME);
+  else if (opt_installed)
+    hy_query_filter (query, HY_PKG_REPONAME, HY_EQ, HY_SYSTEM_REPO_NAME);
 
-  g_ptr_array_sort (pkgs, gptrarr_dnf_package_cmp);
+  // dependency filters are evaluated by libsolv using its provides index
+  if (opt_whatprovides)
+    {
+      // like DNF, file paths also match the packages' file lists
+      hy_autoquery HyQuery files_query = hy_query_clone (query);
+      hy_query_filter_in (files_query, HY_PKG_FILE, HY_GLOB, (const char **) opt_whatprovides);
+      hy_query_filter_in (query, HY_PKG_PROVIDES, HY_GLOB, (const char **) opt_whatprovides);
+      hy_query_union (query, files_query);
+    }
+  if (opt_whatrequires)
+    hy_query_filter_in (query, HY_PKG_REQUIRES, HY_GLOB, (const char **) opt_whatrequires);
+  if (opt_whatrecommends)
+    hy_query_filter_in (query, HY_PKG_RECOMMENDS, HY_GLOB, (const char **) opt_whatrecommends);
 
-  const char *prev_line = "";
-  for (guint i = 0; i < pkgs->len; ++i)
+  dnf_utils_timings_phase ("output");
+  g_autoptr(GString) out = g_string_sized_new (OUTPUT_FLUSH_SIZE + 4096);
+
+  if (opt_provides || opt_requires)
+    {
+      guint rows = output_query_deps (out, sack, query, opt_provides ? SOLVABLE_PROVIDES : SOLVABLE_REQUIRES,
+                                      opt_count);
+      if (opt_count)
+        g_string_append_printf (out, "%u\n", rows);
+    }
+  else if (!opt_info && (!queryformat || queryformat->by_ids))
+    {
+      guint rows = output_query_rows (out, sack, query, queryformat, opt_count);
+      if (opt_count)
+        g_string_append_printf (out, "%u\n", rows);
+    }
+  else if (queryformat)
+    {
+      g_autoptr(GPtrArray) pkgs = hy_query_run (query);
+      g_ptr_array_sort (pkgs, gptrarr_dnf_package_cmp);
+
+      // print each distinct line once, in the order of the sorted packages
+      g_autoptr(GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+      for (guint i = 0; i < pkgs->len; ++i)
+        {
+          gsize start = out->len;
+          query_format_run (queryformat, g_ptr_array_index (pkgs, i), out);
+          g_string_append_c (out, '\n');
+          if (!g_hash_table_add (seen, g_strdup (out->str + start)) || opt_count)
+            g_string_truncate (out, start);
+          output_maybe_flush (out);
+        }
+      if (opt_count)
+        g_string_append_printf (out, "%u\n", g_hash_table_size (seen));
+    }
+  else if (opt_count)
+    {
+      DnfPackageSet *pset = hy_query_run_set (query);
+      g_string_append_printf (out, "%u\n", (guint) dnf_packageset_count (pset));
+      dnf_packageset_free (pset);
+    }
+  else
     {
-      DnfPackage *package = g_ptr_array_index (pkgs, i);
-      if (opt_nevra || !opt_info)
+      g_autoptr(GPtrArray) pkgs = hy_query_run (query);
+      g_ptr_array_sort (pkgs, gptrarr_dnf_package_cmp);
+
+      gboolean info_table = isatty (STDOUT_FILENO);
+      gsize key_width = info_key_width ();
+      for (guint i = 0; i < pkgs->len; ++i)
         {
-          const char * line = dnf_package_get_nevra (package);
-          // print nevras without duplicated lines
-          if (opt_info || strcmp (line, prev_line) != 0)
+          DnfPackage *package = g_ptr_array_index (pkgs, i);
+          if (opt_nevra)
             {
-              g_print ("%s\n", line);
-              prev_line = line;
+              g_string_append (out, dnf_package_get_nevra (package));
+              g_string_append_c (out, '\n');
             }
-        }
-      if (opt_info)
-        {
-          print_package_info (package);
-          g_print ("\n");
+          if (info_table)
+            {
+              output_flush (out);
+              print_package_info_table (package);
+            }
+          else
+            output_package_info (out, key_width, package);
+          g_string_append_c (out, '\n');
+          output_maybe_flush (out);
         }
     }
 
+  output_flush (out);
+  fflush (stdout);
+
   return TRUE;
 }
 
@@ -86,6 +86,10 @@ dnf_command_swap_run (DnfCommand      *cmd,
       return FALSE;
     }
 
+  dnf_utils_timings_phase ("sack setup");
+  if (!dnf_utils_context_setup_sack (ctx, DNF_CONTEXT_SETUP_SACK_FLAG_NONE, error))
+    return FALSE;
+  dnf_utils_timings_phase ("subject resolution");
   /* Install new package */
   if (!dnf_context_install (ctx, pkgs[1], error))
     return FALSE;
@@ -97,12 +101,15 @@ dnf_command_swap_run (DnfCommand      *cmd,
     flags |= DNF_FORCE_BEST;
   if (!dnf_context_get_install_weak_deps ())
     flags |= DNF_IGNORE_WEAK_DEPS;
+  dnf_utils_timings_phase ("depsolve");
   if (!dnf_goal_depsolve (dnf_context_get_goal (ctx), flags, error))
     return FALSE;
+  dnf_utils_timings_phase ("confirmation");
   if (!dnf_utils_print_transaction (ctx))
     return TRUE;
   if (!dnf_utils_userconfirm ())
     return FALSE;
+  dnf_utils_timings_phase ("transaction");
   if (!dnf_context_run (ctx, NULL, error))
     return FALSE;
   g_print ("Complete.\n");
@@ -0,0 +1,291 @@
+/* dnf-command-whatneeds.c
+ *
+ * Copyright © 2026 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dnf-command-whatneeds.h"
+#include "dnf-depgraph.h"
+#include "dnf-utils.h"
+
+struct _DnfCommandWhatneeds
+{
+  PeasExtensionBase parent_instance;
+};
+
+static void dnf_command_whatneeds_iface_init (DnfCommandInterface *iface);
+
+G_DEFINE_DYNAMIC_TYPE_EXTENDED (DnfCommandWhatneeds,
+                                dnf_command_whatneeds,
+                                PEAS_TYPE_EXTENSION_BASE,
+                                0,
+                                G_IMPLEMENT_INTERFACE (DNF_TYPE_COMMAND,
+                                                       dnf_command_whatneeds_iface_init))
+
+static void
+dnf_command_whatneeds_init (DnfCommandWhatneeds *self)
+{
+}
+
+static void
+disable_available_repos (DnfContext *ctx)
+{
+  const GPtrArray *repos = dnf_context_get_repos (ctx);
+
+  for (guint i = 0; i < repos->len; ++i)
+    {
+      DnfRepo *repo = g_ptr_array_index (repos, i);
+      dnf_repo_set_enabled (repo, DNF_REPO_ENABLED_NONE);
+    }
+}
+
+/* Working arrays of the search, indexed by graph node. */
+typedef struct
+{
+  gint *parent;        // the next package on the shortest path towards the target, -1 if not reached
+  gint *first_child;   // the first package having this package as parent, -1 if none
+  gint *next_sibling;  // the next package with the same parent
+  guint *queue;
+  guint *stack;
+  guint *depth;
+} Search;
+
+static void
+search_init (Search *search, guint nnodes)
+{
+  search->parent = g_malloc (nnodes * sizeof (*search->parent));
+  search->first_child = g_malloc (nnodes * sizeof (*search->first_child));
+  search->next_sibling = g_malloc (nnodes * sizeof (*search->next_sibling));
+  search->queue = g_malloc (nnodes * sizeof (*search->queue));
+  search->stack = g_malloc (nnodes * sizeof (*search->stack));
+  search->depth = g_malloc (nnodes * sizeof (*search->depth));
+  for (guint i = 0; i < nnodes; i++)
+    search->parent[i] = search->first_child[i] = -1;
+}
+
+static void
+search_clear (Search *search)
+{
+  g_free (search->parent);
+  g_free (search->first_child);
+  g_free (search->next_sibling);
+  g_free (search->queue);
+  g_free (search->stack);
+  g_free (search->depth);
+}
+
+static gint
+guint_compare_func (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  guint x = *(const guint *)a;
+  guint y = *(const guint *)b;
+
+  if (x < y)
+    return -1;
+  return x > y;
+}
+
+/* Prints the tree of the packages which need the target. Every package is printed under
+ * the package it needs on the shortest dependency path to the target. */
+static void
+print_dependents (const GPtrArray *pkgs, const DnfDepGraph *rgraph, guint target, gboolean direct, Search *search)
+{
+  // breadth-first search over the reversed dependency edges
+  guint head = 0;
+  guint tail = 0;
+  search->queue[tail++] = target;
+  search->parent[target] = target;
+  while (head < tail)
+    {
+      const guint u = search->queue[head++];
+      if (direct && u != target)
+        continue;
+      for (guint e = rgraph->offsets[u]; e < rgraph->offsets[u + 1]; e++)
+        {
+          const guint v = rgraph->targets[e];
+          if (search->parent[v] >= 0)
+            continue;
+          search->parent[v] = u;
+          search->queue[tail++] = v;
+        }
+    }
+
+  // link the children of every package, the lists are built in the descending order
+  // of the packages so they are printed in the ascending order from the stack
+  guint *reached = &search->queue[1];
+  const guint nreached = tail - 1;
+  g_qsort_with_data (reached, nreached, sizeof (*reached), guint_compare_func, NULL);
+  for (guint i = 0; i < nreached; i++)
+    {
+      const guint v = reached[i];
+      const guint u = search->parent[v];
+      search->next_sibling[v] = search->first_child[u];
+      search->first_child[u] = v;
+    }
+
+  g_print ("%s\n", dnf_package_get_nevra (g_ptr_array_index (pkgs, target)));
+  if (nreached == 0)
+    g_print ("  not needed by any installed package\n");
+
+  // depth-first walk of the tree, the target itself is printed above
+  guint top = 0;
+  for (gint v = search->first_child[target]; v >= 0; v = search->next_sibling[v])
+    {
+      search->stack[top++] = v;
+      search->depth[v] = 1;
+    }
+  while (top)
+    {
+      const guint u = search->stack[--top];
+      g_print ("%*s%s\n", (int)(2 * search->depth[u]), "", dnf_package_get_nevra (g_ptr_array_index (pkgs, u)));
+      for (gint v = search->first_child[u]; v >= 0; v = search->next_sibling[v])
+        {
+          search->stack[top++] = v;
+          search->depth[v] = search->depth[u] + 1;
+        }
+    }
+
+  // reset the reached nodes for the next target
+  search->parent[target] = search->first_child[target] = -1;
+  for (guint i = 0; i < nreached; i++)
+    search->parent[reached[i]] = search->first_child[reached[i]] = -1;
+}
+
+static gboolean
+dnf_command_whatneeds_run (DnfCommand      *cmd,
+                           int              argc,
+                           char            *argv[],
+                           GOptionContext  *opt_ctx,
+                           DnfContext      *ctx,
+                           GError         **error)
+{
+  g_auto(GStrv) opt_key = NULL;
+  gboolean opt_direct = FALSE;
+  const GOptionEntry opts[] = {
+    { "direct", '\0', G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &opt_direct, "show only the packages which need the given packages directly", NULL },
+    { G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_STRING_ARRAY, &opt_key, NULL, NULL },
+    { NULL }
+  };
+  g_option_context_add_main_entries (opt_ctx, opts, NULL);
+
+  if (!g_option_context_parse (opt_ctx, &argc, &argv, error))
+    return FALSE;
+
+  if (opt_key == NULL)
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "Packages are not specified");
+      return FALSE;
+    }
+
+  // only look at installed packages
+  disable_available_repos (ctx);
+  dnf_utils_timings_phase ("sack setup");
+  if (!dnf_utils_context_setup_sack (ctx, DNF_CONTEXT_SETUP_SACK_FLAG_NONE, error))
+    return FALSE;
+
+  // the same graph as the autoremove command uses, with the edges reversed, a package
+  // is needed by every package requiring it even if there are other installed providers
+  DnfSack *sack = dnf_context_get_sack (ctx);
+  g_autoptr(GPtrArray) pkgs = dnf_depgraph_get_installed_packages (sack);
+  DnfDepGraphFlags graph_flags = DNF_DEPGRAPH_FLAG_ALL_PROVIDERS | DNF_DEPGRAPH_FLAG_PREREQUIRES;
+  if (dnf_context_get_install_weak_deps ())
+    graph_flags |= DNF_DEPGRAPH_FLAG_RECOMMENDS;
+  g_autoptr(DnfDepGraph) graph = dnf_depgraph_new (sack, pkgs, graph_flags);
+  g_autoptr(DnfDepGraph) rgraph = dnf_depgraph_new_reversed (graph);
+
+  g_autoptr(GHashTable) id2node = g_hash_table_new (g_direct_hash, g_direct_equal);
+  for (guint i = 0; i < pkgs->len; i++)
+    g_hash_table_insert (id2node, GINT_TO_POINTER (dnf_package_get_id (g_ptr_array_index (pkgs, i))),
+                         GUINT_TO_POINTER (i));
+
+  dnf_utils_timings_phase ("subject resolution");
+  g_autoptr(GArray) targets = g_array_new (FALSE, FALSE, sizeof (guint));
+  for (char **pkey = opt_key; *pkey; ++pkey)
+    {
+      g_auto(HySubject) subject = hy_subject_create (*pkey);
+      HyNevra out_nevra;
+      hy_autoquery HyQuery query = hy_subject_get_best_solution (subject, sack, NULL, &out_nevra,
+                                                                 FALSE, TRUE, FALSE, TRUE, FALSE);
+      if (out_nevra)
+        hy_nevra_free (out_nevra);
+      hy_query_filter (query, HY_PKG_REPONAME, HY_EQ, HY_SYSTEM_REPO_NAME);
+      g_autoptr(GPtrArray) matched = hy_query_run (query);
+      if (matched->len == 0)
+        g_print ("No match for argument: %s\n", *pkey);
+      for (guint i = 0; i < matched->len; i++)
+        {
+          DnfPackage *pkg = g_ptr_array_index (matched, i);
+          gpointer node;
+          if (g_hash_table_lookup_extended (id2node, GINT_TO_POINTER (dnf_package_get_id (pkg)), NULL, &node))
+            {
+              guint target = GPOINTER_TO_UINT (node);
+              g_array_append_val (targets, target);
+            }
+        }
+    }
+
+  if (targets->len == 0)
+    {
+      g_set_error_literal (error,
+                           G_IO_ERROR,
+                           G_IO_ERROR_FAILED,
+                           "No installed packages matched");
+      return FALSE;
+    }
+
+  // print every target only once, in the package order
+  g_qsort_with_data (targets->data, targets->len, sizeof (guint), guint_compare_func, NULL);
+  Search search;
+  search_init (&search, pkgs->len);
+  for (guint i = 0; i < targets->len; i++)
+    {
+      const guint target = g_array_index (targets, guint, i);
+      if (i > 0 && g_array_index (targets, guint, i - 1) == target)
+        continue;
+      print_dependents (pkgs, rgraph, target, opt_direct, &search);
+    }
+  search_clear (&search);
+
+  return TRUE;
+}
+
+static void
+dnf_command_whatneeds_class_init (DnfCommandWhatneedsClass *klass)
+{
+}
+
+static void
+dnf_command_whatneeds_iface_init (DnfCommandInterface *iface)
+{
+  iface->run = dnf_command_whatneeds_run;
+}
+
+static void
+dnf_command_whatneeds_class_finalize (DnfCommandWhatneedsClass *klass)
+{
+}
+
+G_MODULE_EXPORT void
+dnf_command_whatneeds_register_types (PeasObjectModule *module)
+{
+  dnf_command_whatneeds_register_type (G_TYPE_MODULE (module));
+
+  peas_object_module_register_extension_type (module,
+                                              DNF_TYPE_COMMAND,
+                                              DNF_TYPE_COMMAND_WHATNEEDS);
+}
@@ -16,6 +16,10 @@ BuildRequires:  pkgconfig(gobject-2.0) >= 2.44.0
 BuildRequires:  pkgconfig(libpeas-1.0) >= 1.20.0
 BuildRequires:  (pkgconfig(libdnf) >= %{libdnf_version} with pkgconfig(libdnf) < 5)
 BuildRequires:  pkgconfig(smartcols)
+BuildRequires:  pkgconfig(sqlite3)
+BuildRequires:  pkgconfig(libcurl)
+BuildRequires:  pkgconfig(zck)
+BuildRequires:  pkgconfig(librepo)
 BuildRequires:  help2man
 
 Requires:       libdnf%{?_isa} >= %{libdnf_version}